@@ -0,0 +1,173 @@
+/*
+ *  libsockmux - A socket muxer library
+ *
+ *    Copyright (C) 2011 Daniel Mack <sockmux@zonque.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Sends JSON telemetry records of a fixed size through a sender into
+ * memory, with and without compression, and parses the result with a
+ * receiver. Reports the size on the wire relative to the payload and
+ * the payload throughput of both sides, to help picking a value for
+ * the "compression-threshold" property.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "src/sender.h"
+#include "src/receiver.h"
+
+#define SOCKMUX_PROTOCOL_MAGIC 0x7ab938ab
+#define TOTAL_SIZE (32 * 1024 * 1024)
+
+static const guint message_sizes[] = { 64, 256, 1024, 4096, 16384, 65536 };
+
+static GMainLoop *loop;
+static guint n_received;
+
+static void receiver_cb (SockMuxReceiver *rec,
+                         guint message_id,
+                         const guint8 *data,
+                         guint size,
+                         gpointer userdata)
+{
+  n_received++;
+}
+
+static void stream_end_cb (SockMuxReceiver *rec,
+                           gpointer userdata)
+{
+  g_main_loop_quit(loop);
+}
+
+static guint8 *make_record (guint size,
+                            guint seq)
+{
+  GString *str = g_string_sized_new(size + 128);
+
+  while (str->len < size)
+    g_string_append_printf(str,
+                           "{\"seq\":%u,\"ts\":%" G_GINT64_FORMAT ",\"sensor\":\"temp-%03u\","
+                           "\"value\":%.3f,\"unit\":\"C\",\"status\":\"ok\"},",
+                           seq, g_get_real_time(), g_random_int_range(0, 64),
+                           g_random_double_range(-20.0, 50.0));
+
+  g_string_truncate(str, size);
+
+  return (guint8 *) g_string_free(str, FALSE);
+}
+
+static gdouble mb_per_sec (gsize size,
+                           gint64 usec)
+{
+  return size / (MAX(usec, 1) / (gdouble) G_USEC_PER_SEC) / (1024 * 1024);
+}
+
+static void run (SockMuxSenderCompression compression,
+                 guint message_size)
+{
+  SockMuxSender *sender;
+  SockMuxReceiver *receiver;
+  GOutputStream *output;
+  GInputStream *input;
+  guint8 **records;
+  gsize wire_size;
+  guint i, n_messages;
+  gint64 start, encode_time, decode_time;
+
+  n_messages = TOTAL_SIZE / message_size;
+  records = g_new(guint8 *, n_messages);
+  for (i = 0; i < n_messages; i++)
+    records[i] = make_record(message_size, i);
+
+  output = g_memory_output_stream_new_resizable();
+  sender = sockmux_sender_new_full(output, SOCKMUX_PROTOCOL_MAGIC, 2);
+  g_object_set(sender,
+               SOCKMUX_SENDER_PROP_COMPRESSION, compression,
+               SOCKMUX_SENDER_PROP_COMPRESSION_THRESHOLD, 0,
+               NULL);
+
+  /* there is no peer receiver to announce this */
+  sockmux_sender_set_peer_capabilities(sender, SOCKMUX_CAPABILITY_ZLIB);
+
+  start = g_get_monotonic_time();
+
+  for (i = 0; i < n_messages; i++)
+    sockmux_sender_send(sender, i, records[i], message_size);
+
+  while (sockmux_sender_get_queue_length(sender) > 0)
+    g_main_context_iteration(NULL, TRUE);
+
+  encode_time = g_get_monotonic_time() - start;
+
+  g_output_stream_close(output, NULL, NULL);
+  wire_size = g_memory_output_stream_get_data_size(G_MEMORY_OUTPUT_STREAM(output));
+  input = g_memory_input_stream_new_from_data(g_memory_output_stream_steal_data(G_MEMORY_OUTPUT_STREAM(output)),
+                                              wire_size, g_free);
+
+  n_received = 0;
+  receiver = sockmux_receiver_new(input, SOCKMUX_PROTOCOL_MAGIC);
+  sockmux_receiver_connect(receiver, receiver_cb, NULL);
+  g_signal_connect(receiver, "stream-end", G_CALLBACK(stream_end_cb), NULL);
+
+  start = g_get_monotonic_time();
+  g_main_loop_run(loop);
+  decode_time = g_get_monotonic_time() - start;
+
+  if (n_received != n_messages)
+    g_error("received %u of %u messages", n_received, n_messages);
+
+  printf("%s %u %.3f %.1f %.1f\n",
+         compression == SOCKMUX_SENDER_COMPRESSION_ZLIB ? "zlib" : "none",
+         message_size,
+         wire_size / (gdouble) ((gsize) n_messages * message_size),
+         mb_per_sec((gsize) n_messages * message_size, encode_time),
+         mb_per_sec((gsize) n_messages * message_size, decode_time));
+
+  g_object_unref(receiver);
+  g_object_unref(input);
+  g_object_unref(sender);
+  g_object_unref(output);
+
+  for (i = 0; i < n_messages; i++)
+    g_free(records[i]);
+  g_free(records);
+}
+
+int main(int argc, char *argv[])
+{
+  guint i;
+
+  loop = g_main_loop_new(NULL, FALSE);
+
+  printf("# codec message_size wire_ratio encode_mb_per_sec decode_mb_per_sec\n");
+
+  for (i = 0; i < G_N_ELEMENTS(message_sizes); i++)
+    {
+      run(SOCKMUX_SENDER_COMPRESSION_NONE, message_sizes[i]);
+      run(SOCKMUX_SENDER_COMPRESSION_ZLIB, message_sizes[i]);
+    }
+
+  g_main_loop_unref(loop);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,437 @@
+/*
+ *  libsockmux - A socket muxer library
+ *
+ *    Copyright (C) 2011 Daniel Mack <sockmux@zonque.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Runs messages between pairs of senders and receivers in one process,
+ * over pipes, socketpairs and loopback TCP, for a range of message sizes
+ * and numbers of concurrent connections. In pipelined mode, a window of
+ * messages is kept in flight on each connection; in request/response
+ * mode, each message is echoed back before the next one is sent.
+ *
+ * Prints one line per run. Throughput counts the payload in the client
+ * to server direction only, latency is from sending a message to its
+ * callback (pipelined) or to the callback of its echo (request/response).
+ * Pool misses are the allocations of the shared block pool that could
+ * not be served from its free lists, per message. Allocations made with
+ * plain g_malloc(), by GLib or by GIO are not counted.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
+
+#include "src/pool.h"
+#include "src/sender.h"
+#include "src/receiver.h"
+
+#define SOCKMUX_PROTOCOL_MAGIC 0x7ab938ab
+#define MESSAGE_ID 0x100
+#define TOTAL_SIZE (256 * 1024 * 1024)
+#define WINDOW 32
+#define WINDOW_SIZE (4 * 1024 * 1024)
+
+typedef enum {
+  TRANSPORT_PIPE,
+  TRANSPORT_SOCKETPAIR,
+  TRANSPORT_TCP,
+  N_TRANSPORTS
+} Transport;
+
+typedef enum {
+  MODE_PIPELINED,
+  MODE_REQUEST_RESPONSE,
+  N_MODES
+} Mode;
+
+static const gchar *transport_names[] = { "pipe", "socketpair", "tcp" };
+static const gchar *mode_names[] = { "pipelined", "request-response" };
+
+static const guint message_sizes[] = {
+  0, 64, 1024, 16 * 1024, 256 * 1024, 1024 * 1024, 16 * 1024 * 1024
+};
+static const guint quick_message_sizes[] = { 0, 64, 4096, 65536, 1024 * 1024 };
+static const guint connection_counts[] = { 1, 8 };
+
+typedef struct {
+  gint             fds[4];
+  GOutputStream   *client_output;
+  GInputStream    *client_input;
+  GOutputStream   *server_output;
+  GInputStream    *server_input;
+  SockMuxSender   *client_sender;
+  SockMuxReceiver *client_receiver;
+  SockMuxSender   *server_sender;
+  SockMuxReceiver *server_receiver;
+  GArray          *send_times;
+  guint            sent;
+  guint            received;
+} Connection;
+
+static GMainLoop *loop;
+static guint8 *payload;
+static guint message_size;
+static guint n_messages;
+static Mode mode;
+static GArray *latencies;
+static guint n_running;
+
+static gchar *opt_transport;
+static gchar *opt_mode;
+static gint opt_connections;
+static gint opt_protocol_version = 1;
+static gboolean opt_quick;
+
+static GOptionEntry entries[] = {
+  { "transport", 't', 0, G_OPTION_ARG_STRING, &opt_transport,
+    "Only use TRANSPORT (pipe, socketpair or tcp)", "TRANSPORT" },
+  { "mode", 'm', 0, G_OPTION_ARG_STRING, &opt_mode,
+    "Only run MODE (pipelined or request-response)", "MODE" },
+  { "connections", 'n', 0, G_OPTION_ARG_INT, &opt_connections,
+    "Only run with N concurrent connections", "N" },
+  { "protocol-version", 'p', 0, G_OPTION_ARG_INT, &opt_protocol_version,
+    "Protocol version to use, defaults to 1", "VERSION" },
+  { "quick", 'q', 0, G_OPTION_ARG_NONE, &opt_quick,
+    "Fewer message sizes and a tenth of the messages", NULL },
+  { NULL }
+};
+
+static void send_next (Connection *conn)
+{
+  gint64 now = g_get_monotonic_time();
+
+  g_array_append_val(conn->send_times, now);
+  conn->sent++;
+  sockmux_sender_send(conn->client_sender, MESSAGE_ID, payload, message_size);
+}
+
+static void message_done (Connection *conn)
+{
+  gint64 latency = g_get_monotonic_time() -
+                   g_array_index(conn->send_times, gint64, conn->received);
+
+  g_array_append_val(latencies, latency);
+  conn->received++;
+
+  if (conn->sent < n_messages)
+    send_next(conn);
+  else if (conn->received == n_messages && --n_running == 0)
+    g_main_loop_quit(loop);
+}
+
+static void server_cb (SockMuxReceiver *rec,
+                       guint message_id,
+                       const guint8 *data,
+                       guint size,
+                       gpointer userdata)
+{
+  Connection *conn = userdata;
+
+  if (mode == MODE_PIPELINED)
+    message_done(conn);
+  else
+    sockmux_sender_send(conn->server_sender, message_id, data, size);
+}
+
+static void client_cb (SockMuxReceiver *rec,
+                       guint message_id,
+                       const guint8 *data,
+                       guint size,
+                       gpointer userdata)
+{
+  message_done(userdata);
+}
+
+static void tcp_pair (gint *client,
+                      gint *server)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  gint listener, one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr *) &addr, &len) < 0)
+    g_error("listening on loopback failed: %s", g_strerror(errno));
+
+  *client = socket(AF_INET, SOCK_STREAM, 0);
+  if (*client < 0 ||
+      connect(*client, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    g_error("connecting to loopback failed: %s", g_strerror(errno));
+
+  *server = accept(listener, NULL, NULL);
+  if (*server < 0)
+    g_error("accept() failed: %s", g_strerror(errno));
+
+  close(listener);
+
+  setsockopt(*client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setsockopt(*server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/*
+ * fds[0] and fds[1] are the client's ends for reading and writing,
+ * fds[2] and fds[3] the server's. Sockets are used in both directions.
+ */
+static Connection *connection_new (Transport transport)
+{
+  Connection *conn = g_new0(Connection, 1);
+  gint p[2], q[2];
+
+  switch (transport)
+    {
+      case TRANSPORT_PIPE:
+        if (pipe(p) < 0 || pipe(q) < 0)
+          g_error("pipe() failed: %s", g_strerror(errno));
+
+        conn->fds[0] = q[0];
+        conn->fds[1] = p[1];
+        conn->fds[2] = p[0];
+        conn->fds[3] = q[1];
+        break;
+
+      case TRANSPORT_SOCKETPAIR:
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, p) < 0)
+          g_error("socketpair() failed: %s", g_strerror(errno));
+
+        conn->fds[0] = conn->fds[1] = p[0];
+        conn->fds[2] = conn->fds[3] = p[1];
+        break;
+
+      default:
+        tcp_pair(&p[0], &p[1]);
+        conn->fds[0] = conn->fds[1] = p[0];
+        conn->fds[2] = conn->fds[3] = p[1];
+        break;
+    }
+
+  conn->client_input = g_unix_input_stream_new(conn->fds[0], FALSE);
+  conn->client_output = g_unix_output_stream_new(conn->fds[1], FALSE);
+  conn->server_input = g_unix_input_stream_new(conn->fds[2], FALSE);
+  conn->server_output = g_unix_output_stream_new(conn->fds[3], FALSE);
+
+  conn->client_sender = sockmux_sender_new_full(conn->client_output,
+                                                SOCKMUX_PROTOCOL_MAGIC,
+                                                opt_protocol_version);
+  conn->server_sender = sockmux_sender_new_full(conn->server_output,
+                                                SOCKMUX_PROTOCOL_MAGIC,
+                                                opt_protocol_version);
+
+  conn->server_receiver = sockmux_receiver_new(conn->server_input, SOCKMUX_PROTOCOL_MAGIC);
+  sockmux_receiver_connect(conn->server_receiver, server_cb, conn);
+  conn->client_receiver = sockmux_receiver_new(conn->client_input, SOCKMUX_PROTOCOL_MAGIC);
+  sockmux_receiver_connect(conn->client_receiver, client_cb, conn);
+
+  conn->send_times = g_array_sized_new(FALSE, FALSE, sizeof(gint64), n_messages);
+
+  return conn;
+}
+
+static void connection_free (Connection *conn)
+{
+  guint i;
+
+  g_object_unref(conn->client_receiver);
+  g_object_unref(conn->server_receiver);
+  g_object_unref(conn->client_sender);
+  g_object_unref(conn->server_sender);
+
+  /* let cancelled operations finish before the descriptors go away */
+  while (g_main_context_iteration(NULL, FALSE));
+
+  g_object_unref(conn->client_input);
+  g_object_unref(conn->client_output);
+  g_object_unref(conn->server_input);
+  g_object_unref(conn->server_output);
+
+  for (i = 0; i < G_N_ELEMENTS(conn->fds); i++)
+    if (i == 0 || conn->fds[i] != conn->fds[i - 1])
+      close(conn->fds[i]);
+
+  g_array_free(conn->send_times, TRUE);
+  g_free(conn);
+}
+
+static gint compare_latency (gconstpointer a,
+                             gconstpointer b)
+{
+  gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static gint64 percentile (gdouble p)
+{
+  guint i = MIN(latencies->len * p, latencies->len - 1);
+
+  return g_array_index(latencies, gint64, i);
+}
+
+static void run (Transport transport,
+                 Mode m,
+                 guint n_connections,
+                 guint size)
+{
+  Connection **conns;
+  SockMuxPoolStats before, after;
+  guint i, j, total, window;
+  gint64 start, elapsed;
+
+  mode = m;
+  message_size = size;
+
+  if (mode == MODE_PIPELINED)
+    n_messages = CLAMP(TOTAL_SIZE / MAX(size, 1), 16, 100000);
+  else
+    n_messages = CLAMP(TOTAL_SIZE / MAX(size, 1), 16, 10000);
+
+  n_messages = MAX(n_messages / n_connections / (opt_quick ? 10 : 1), 16);
+  total = n_messages * n_connections;
+
+  conns = g_new(Connection *, n_connections);
+  for (i = 0; i < n_connections; i++)
+    conns[i] = connection_new(transport);
+
+  latencies = g_array_sized_new(FALSE, FALSE, sizeof(gint64), total);
+  n_running = n_connections;
+
+  window = mode == MODE_PIPELINED ?
+             CLAMP(WINDOW_SIZE / MAX(size, 1), 1, WINDOW) : 1;
+  window = MIN(window, n_messages);
+
+  sockmux_pool_get_stats(&before);
+  start = g_get_monotonic_time();
+
+  for (i = 0; i < n_connections; i++)
+    for (j = 0; j < window; j++)
+      send_next(conns[i]);
+
+  g_main_loop_run(loop);
+
+  elapsed = MAX(g_get_monotonic_time() - start, 1);
+  sockmux_pool_get_stats(&after);
+
+  g_array_sort(latencies, compare_latency);
+
+  printf("%s %s %u %u %u %.0f %.1f %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+         " %" G_GINT64_FORMAT " %.3f\n",
+         transport_names[transport], mode_names[mode], n_connections, size, total,
+         total / (elapsed / (gdouble) G_USEC_PER_SEC),
+         (gdouble) total * size / (elapsed / (gdouble) G_USEC_PER_SEC) / (1024 * 1024),
+         percentile(0.5), percentile(0.99), percentile(0.999),
+         (gdouble) (after.misses + after.oversized - before.misses - before.oversized) / total);
+  fflush(stdout);
+
+  for (i = 0; i < n_connections; i++)
+    connection_free(conns[i]);
+
+  g_free(conns);
+  g_array_free(latencies, TRUE);
+}
+
+static gint lookup (const gchar *name,
+                    const gchar **names,
+                    gint n_names)
+{
+  gint i;
+
+  for (i = 0; i < n_names; i++)
+    if (g_strcmp0(name, names[i]) == 0)
+      return i;
+
+  g_printerr("unknown name: %s\n", name);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  const guint *sizes;
+  guint n_sizes, i, j, c, t, m;
+
+  context = g_option_context_new("- end-to-end sockmux benchmark");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+      g_printerr("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+  g_option_context_free(context);
+
+  signal(SIGPIPE, SIG_IGN);
+
+  loop = g_main_loop_new(NULL, FALSE);
+
+  sizes = opt_quick ? quick_message_sizes : message_sizes;
+  n_sizes = opt_quick ? G_N_ELEMENTS(quick_message_sizes) : G_N_ELEMENTS(message_sizes);
+
+  payload = g_malloc0(sizes[n_sizes - 1]);
+  for (i = 0; i < sizes[n_sizes - 1]; i++)
+    payload[i] = i;
+
+  printf("# transport mode connections message_size messages msgs_per_sec mb_per_sec "
+         "p50_usec p99_usec p999_usec pool_misses_per_msg\n");
+
+  for (t = 0; t < N_TRANSPORTS; t++)
+    {
+      if (opt_transport && (guint) lookup(opt_transport, transport_names, N_TRANSPORTS) != t)
+        continue;
+
+      for (m = 0; m < N_MODES; m++)
+        {
+          if (opt_mode && (guint) lookup(opt_mode, mode_names, N_MODES) != m)
+            continue;
+
+          for (c = 0; c < G_N_ELEMENTS(connection_counts); c++)
+            {
+              guint n_connections = opt_connections > 0 ?
+                                      (guint) opt_connections : connection_counts[c];
+
+              for (j = 0; j < n_sizes; j++)
+                run(t, m, n_connections, sizes[j]);
+
+              if (opt_connections > 0)
+                break;
+            }
+        }
+    }
+
+  g_free(payload);
+  g_main_loop_unref(loop);
+
+  return EXIT_SUCCESS;
+}
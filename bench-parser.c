@@ -0,0 +1,215 @@
+/*
+ *  libsockmux - A socket muxer library
+ *
+ *    Copyright (C) 2011 Daniel Mack <sockmux@zonque.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Feeds pre-encoded messages from memory through a SockMuxReceiver and
+ * reports the parsing cost per message, without any socket in the way.
+ * The input is either read from a GMemoryInputStream or passed in with
+ * sockmux_receiver_feed(), in pieces of the size a read would return.
+ *
+ * Messages are spread over 10000 IDs, and 0 to 10000 callbacks are
+ * connected, either one per ID (filtered, looked up by ID) or as
+ * single-ID ranges (walked for every message). Messages of "mixed" size
+ * are log-uniformly distributed up to 4 KiB. Smaller messages mean more
+ * messages per read; the cost per message should not depend on that.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "src/protocol.h"
+#include "src/receiver.h"
+
+#define SOCKMUX_PROTOCOL_MAGIC 0x7ab938ab
+#define PROTOCOL_VERSION 1
+#define TOTAL_SIZE (64 * 1024 * 1024)
+#define MAX_MESSAGES 2000000
+#define N_MESSAGE_IDS 10000
+#define FEED_SIZE (64 * 1024)
+#define MIXED_SIZE G_MAXUINT
+
+typedef enum {
+  CALLBACKS_FILTERED,
+  CALLBACKS_RANGE
+} CallbackKind;
+
+static const guint message_sizes[] = { 0, 8, 64, 512, 4096, 65536, MIXED_SIZE };
+static const guint callback_counts[] = { 0, 1, 100, 10000 };
+
+static GMainLoop *loop;
+
+static void receiver_cb (SockMuxReceiver *rec,
+                         guint message_id,
+                         const guint8 *data,
+                         guint size,
+                         gpointer userdata)
+{
+}
+
+static void stream_end_cb (SockMuxReceiver *rec,
+                           gpointer userdata)
+{
+  g_main_loop_quit(loop);
+}
+
+static guint8 *encode_messages (guint message_size,
+                                guint n_messages,
+                                gsize *size)
+{
+  SockMuxHandshake hs;
+  SockMuxMessage msg;
+  GRand *rand = g_rand_new_with_seed(0);
+  guint8 *data, *p;
+  guint *sizes;
+  guint i;
+
+  sizes = g_new(guint, n_messages);
+  *size = sizeof(hs);
+
+  for (i = 0; i < n_messages; i++)
+    {
+      if (message_size == MIXED_SIZE)
+        sizes[i] = g_rand_int_range(rand, 0, 2 << g_rand_int_range(rand, 0, 12));
+      else
+        sizes[i] = message_size;
+
+      *size += sizeof(msg) + sizes[i];
+    }
+
+  p = data = g_malloc0(*size);
+
+  hs.magic = GUINT_TO_BE(SOCKMUX_PROTOCOL_MAGIC);
+  hs.protocol_version = GUINT_TO_BE(PROTOCOL_VERSION);
+  memcpy(p, &hs, sizeof(hs));
+  p += sizeof(hs);
+
+  for (i = 0; i < n_messages; i++)
+    {
+      msg.magic = GUINT_TO_BE(SOCKMUX_PROTOCOL_MAGIC);
+      msg.message_id = GUINT_TO_BE(i % N_MESSAGE_IDS);
+      msg.length = GUINT_TO_BE(sizes[i]);
+      memcpy(p, &msg, sizeof(msg));
+      p += sizeof(msg) + sizes[i];
+    }
+
+  g_free(sizes);
+  g_rand_free(rand);
+
+  return data;
+}
+
+static void run (guint message_size,
+                 CallbackKind kind,
+                 guint n_callbacks,
+                 gboolean feed)
+{
+  SockMuxReceiver *receiver;
+  SockMuxReceiverStats stats;
+  GInputStream *input = NULL;
+  guint8 *data;
+  gsize size, pos;
+  guint i, n_messages;
+  gint64 start, end;
+
+  n_messages = TOTAL_SIZE / (sizeof(SockMuxMessage) +
+                             (message_size == MIXED_SIZE ? 512 : message_size));
+  n_messages = MIN(n_messages, MAX_MESSAGES);
+
+  /* every message walks all ranges, keep the run time in check */
+  if (kind == CALLBACKS_RANGE)
+    n_messages = MAX(n_messages / MAX(n_callbacks / 100, 1), N_MESSAGE_IDS);
+
+  data = encode_messages(message_size, n_messages, &size);
+
+  if (!feed)
+    input = g_memory_input_stream_new_from_data(data, size, NULL);
+
+  receiver = sockmux_receiver_new(input, SOCKMUX_PROTOCOL_MAGIC);
+  g_signal_connect(receiver, "stream-end", G_CALLBACK(stream_end_cb), NULL);
+
+  for (i = 0; i < n_callbacks; i++)
+    {
+      if (kind == CALLBACKS_FILTERED)
+        sockmux_receiver_connect_filtered(receiver, i, receiver_cb, NULL);
+      else
+        sockmux_receiver_connect_range(receiver, i, i, receiver_cb, NULL);
+    }
+
+  start = g_get_monotonic_time();
+
+  if (feed)
+    for (pos = 0; pos < size; pos += FEED_SIZE)
+      sockmux_receiver_feed(receiver, data + pos, MIN(FEED_SIZE, size - pos));
+  else
+    g_main_loop_run(loop);
+
+  end = g_get_monotonic_time();
+
+  sockmux_receiver_get_stats(receiver, &stats);
+  if (stats.messages_received != n_messages)
+    g_error("received %" G_GUINT64_FORMAT " of %u messages",
+            stats.messages_received, n_messages);
+
+  if (message_size == MIXED_SIZE)
+    printf("mixed");
+  else
+    printf("%u", message_size);
+
+  printf(" %s %s %u %u %.1f %.1f\n",
+         feed ? "feed" : "stream",
+         kind == CALLBACKS_FILTERED ? "filtered" : "range",
+         n_callbacks, n_messages,
+         (end - start) * 1000.0 / n_messages,
+         size / (MAX(end - start, 1) / (gdouble) G_USEC_PER_SEC) / (1024 * 1024));
+
+  g_object_unref(receiver);
+  if (input)
+    g_object_unref(input);
+  g_free(data);
+}
+
+int main(int argc, char *argv[])
+{
+  guint i, j;
+
+  loop = g_main_loop_new(NULL, FALSE);
+
+  printf("# message_size input callback_kind callbacks messages ns_per_message mb_per_sec\n");
+
+  for (i = 0; i < G_N_ELEMENTS(message_sizes); i++)
+    {
+      run(message_sizes[i], CALLBACKS_FILTERED, 0, FALSE);
+      run(message_sizes[i], CALLBACKS_FILTERED, 0, TRUE);
+
+      for (j = 1; j < G_N_ELEMENTS(callback_counts); j++)
+        {
+          run(message_sizes[i], CALLBACKS_FILTERED, callback_counts[j], TRUE);
+          run(message_sizes[i], CALLBACKS_RANGE, callback_counts[j], TRUE);
+        }
+    }
+
+  g_main_loop_unref(loop);
+
+  return EXIT_SUCCESS;
+}
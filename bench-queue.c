@@ -0,0 +1,83 @@
+/*
+ *  libsockmux - A socket muxer library
+ *
+ *    Copyright (C) 2011 Daniel Mack <sockmux@zonque.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Measures the cost of queueing a message while the output stream is
+ * stalled: nobody reads from the pipe and the main loop never runs, so
+ * every message stays in the sender's queue. The time per send should
+ * stay flat no matter how long the queue already is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <gio/gunixoutputstream.h>
+
+#include "src/sender.h"
+
+#define SOCKMUX_PROTOCOL_MAGIC 0x7ab938ab
+#define N_ROUNDS 20
+#define N_MESSAGES_PER_ROUND 10000
+#define MESSAGE_SIZE 16
+
+int main(int argc, char *argv[])
+{
+  gint ret, fds[2], round, i;
+  guint8 data[MESSAGE_SIZE] = { 0 };
+  GOutputStream *output;
+  SockMuxSender *sender;
+
+  ret = pipe(fds);
+
+  if (ret < 0)
+    {
+      g_error("pipe() failed, ret = %d", ret);
+      exit(EXIT_FAILURE);
+    }
+
+  output = g_unix_output_stream_new(fds[1], TRUE);
+  sender = sockmux_sender_new(output, SOCKMUX_PROTOCOL_MAGIC);
+
+  printf("# queued_messages queued_bytes ns_per_send\n");
+
+  for (round = 0; round < N_ROUNDS; round++)
+    {
+      gint64 start, end;
+
+      start = g_get_monotonic_time();
+      for (i = 0; i < N_MESSAGES_PER_ROUND; i++)
+        sockmux_sender_send(sender, i, data, sizeof(data));
+      end = g_get_monotonic_time();
+
+      printf("%u %" G_GSIZE_FORMAT " %.1f\n",
+             sockmux_sender_get_queue_length(sender),
+             sockmux_sender_get_queue_size(sender),
+             (end - start) * 1000.0 / N_MESSAGES_PER_ROUND);
+    }
+
+  sockmux_sender_reset(sender);
+  g_object_unref(sender);
+  close(fds[0]);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,38 @@
+/*
+ * libsockmux - A socket muxer library
+ *
+ *   Copyright (C) 2011 Daniel Mack <sockmux@zonque.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA.
+ */
+
+#ifndef _LIBSOCKMUX_GLIB_POOL_PRIVATE_H_
+#define _LIBSOCKMUX_GLIB_POOL_PRIVATE_H_
+
+#include <glib.h>
+
+#include "pool.h"
+
+G_BEGIN_DECLS
+
+/* like g_slice_alloc() and g_slice_free1(), @size must match */
+gpointer sockmux_pool_alloc (gsize size);
+void sockmux_pool_free (gpointer mem,
+                        gsize    size);
+
+G_END_DECLS
+
+#endif /* _LIBSOCKMUX_GLIB_POOL_PRIVATE_H_ */
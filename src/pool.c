@@ -0,0 +1,188 @@
+/*
+ * libsockmux - A socket muxer library
+ *
+ *   Copyright (C) 2011 Daniel Mack <sockmux@zonque.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA.
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "pool-private.h"
+
+#define POOL_MIN_SHIFT 6
+#define POOL_MAX_SHIFT 16
+#define POOL_N_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+/* the most a single size class keeps around */
+#define POOL_MAX_CACHED (1024 * 1024)
+
+typedef struct _SockMuxPoolBlock SockMuxPoolBlock;
+typedef struct _SockMuxPoolClass SockMuxPoolClass;
+
+struct _SockMuxPoolBlock {
+  SockMuxPoolBlock *next;
+};
+
+struct _SockMuxPoolClass {
+  GMutex            mutex;
+  SockMuxPoolBlock *free;
+  guint             n_free;
+  guint64           hits;
+  guint64           misses;
+};
+
+/* statically allocated mutexes need no initialisation */
+static SockMuxPoolClass classes[POOL_N_CLASSES];
+static GMutex oversized_mutex;
+static guint64 oversized;
+
+/* returns the index of the smallest class that fits @size, or -1 */
+static gint
+sockmux_pool_class (gsize size)
+{
+  guint shift = MAX(g_bit_storage(size > 0 ? size - 1 : 0), POOL_MIN_SHIFT);
+
+  if (shift > POOL_MAX_SHIFT)
+    return -1;
+
+  return shift - POOL_MIN_SHIFT;
+}
+
+static guint
+sockmux_pool_max_free (gint c)
+{
+  return MAX(POOL_MAX_CACHED >> (c + POOL_MIN_SHIFT), 16);
+}
+
+gpointer
+sockmux_pool_alloc (gsize size)
+{
+  SockMuxPoolClass *pc;
+  SockMuxPoolBlock *block;
+  gint c = sockmux_pool_class(size);
+
+  if (c < 0)
+    {
+      g_mutex_lock(&oversized_mutex);
+      oversized++;
+      g_mutex_unlock(&oversized_mutex);
+
+      return g_malloc(size);
+    }
+
+  pc = &classes[c];
+
+  g_mutex_lock(&pc->mutex);
+  block = pc->free;
+  if (block)
+    {
+      pc->free = block->next;
+      pc->n_free--;
+      pc->hits++;
+    }
+  else
+    pc->misses++;
+  g_mutex_unlock(&pc->mutex);
+
+  if (block == NULL)
+    block = g_malloc((gsize) 1 << (c + POOL_MIN_SHIFT));
+
+  return block;
+}
+
+void
+sockmux_pool_free (gpointer mem,
+                   gsize    size)
+{
+  SockMuxPoolClass *pc;
+  SockMuxPoolBlock *block = mem;
+  gint c = sockmux_pool_class(size);
+
+  if (mem == NULL)
+    return;
+
+  if (c < 0)
+    {
+      g_free(mem);
+      return;
+    }
+
+  pc = &classes[c];
+
+  g_mutex_lock(&pc->mutex);
+  if (pc->n_free < sockmux_pool_max_free(c))
+    {
+      block->next = pc->free;
+      pc->free = block;
+      pc->n_free++;
+      block = NULL;
+    }
+  g_mutex_unlock(&pc->mutex);
+
+  g_free(block);
+}
+
+void
+sockmux_pool_get_stats (SockMuxPoolStats *stats)
+{
+  gint c;
+
+  g_return_if_fail(stats != NULL);
+
+  memset(stats, 0, sizeof(*stats));
+
+  for (c = 0; c < POOL_N_CLASSES; c++)
+    {
+      SockMuxPoolClass *pc = &classes[c];
+
+      g_mutex_lock(&pc->mutex);
+      stats->hits += pc->hits;
+      stats->misses += pc->misses;
+      stats->cached += (gsize) pc->n_free << (c + POOL_MIN_SHIFT);
+      g_mutex_unlock(&pc->mutex);
+    }
+
+  g_mutex_lock(&oversized_mutex);
+  stats->oversized = oversized;
+  g_mutex_unlock(&oversized_mutex);
+}
+
+void
+sockmux_pool_trim (void)
+{
+  gint c;
+
+  for (c = 0; c < POOL_N_CLASSES; c++)
+    {
+      SockMuxPoolClass *pc = &classes[c];
+      SockMuxPoolBlock *block, *next;
+
+      g_mutex_lock(&pc->mutex);
+      block = pc->free;
+      pc->free = NULL;
+      pc->n_free = 0;
+      g_mutex_unlock(&pc->mutex);
+
+      for (; block; block = next)
+        {
+          next = block->next;
+          g_free(block);
+        }
+    }
+}
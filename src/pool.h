@@ -0,0 +1,49 @@
+/*
+ * libsockmux - A socket muxer library
+ *
+ *   Copyright (C) 2011 Daniel Mack <sockmux@zonque.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA.
+ */
+
+#ifndef _LIBSOCKMUX_GLIB_POOL_H_
+#define _LIBSOCKMUX_GLIB_POOL_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Queue entries and payload copies of senders and receivers are taken
+ * from process wide free lists of power-of-two sizes up to 64 KiB, so
+ * steady traffic does not hit the heap. Larger blocks are allocated
+ * and freed directly.
+ */
+typedef struct {
+  guint64 hits;      /* allocations served from a free list */
+  guint64 misses;    /* allocations that had to go to the heap */
+  guint64 oversized; /* allocations too large for any free list */
+  gsize   cached;    /* bytes held in the free lists */
+} SockMuxPoolStats;
+
+void sockmux_pool_get_stats (SockMuxPoolStats *stats);
+
+/* gives the memory held in the free lists back to the heap */
+void sockmux_pool_trim (void);
+
+G_END_DECLS
+
+#endif /* _LIBSOCKMUX_GLIB_POOL_H_ */
@@ -29,6 +29,19 @@ struct _SockMuxHandshake {
 
 typedef struct _SockMuxHandshake SockMuxHandshake;
 
+/*
+ * From protocol version 2 on, the handshake also announces what the
+ * receiver on the sending side can decode (SockMuxCapabilities), so
+ * the peer's sender knows what it may use.
+ */
+struct _SockMuxHandshake2 {
+  guint32 magic;
+  guint32 protocol_version;
+  guint32 capabilities;
+} __attribute__((packed));
+
+typedef struct _SockMuxHandshake2 SockMuxHandshake2;
+
 struct _SockMuxMessage {
   guint32 magic;
   guint32 message_id;
@@ -38,4 +51,59 @@ struct _SockMuxMessage {
 
 typedef struct _SockMuxMessage SockMuxMessage;
 
+/*
+ * Protocol version 2 splits messages into frames of at most one chunk,
+ * so frames of messages on different lanes can be interleaved. Frames
+ * of one lane always belong to the same message until one with
+ * SOCKMUX_FRAME_END is seen.
+ */
+#define SOCKMUX_FRAME_LANES 4
+
+#define SOCKMUX_FRAME_BEGIN      (1 << 0)
+#define SOCKMUX_FRAME_END        (1 << 1)
+#define SOCKMUX_FRAME_CONTROL    (1 << 2)
+#define SOCKMUX_FRAME_COMPRESSED (1 << 3)
+
+/*
+ * Set on the frames of messages that were charged to the credit of
+ * their message ID. The receiver only gives credit back for those, and
+ * not for messages sent before the first credit arrived.
+ */
+#define SOCKMUX_FRAME_CREDITED   (1 << 4)
+
+struct _SockMuxFrame {
+  guint32 magic;
+  guint32 message_id;
+  guint32 length;
+  guint32 total_length;
+  guint8  lane;
+  guint8  flags;
+  guint16 reserved;
+  guchar data[0];
+} __attribute__((packed));
+
+typedef struct _SockMuxFrame SockMuxFrame;
+
+/*
+ * Payload of a single control frame: the receiver of the channel
+ * (message ID) in the frame header allows its peer to send @credit
+ * more bytes of payload on it.
+ */
+struct _SockMuxCredit {
+  guint32 credit;
+} __attribute__((packed));
+
+typedef struct _SockMuxCredit SockMuxCredit;
+
+/*
+ * The payload of a message with SOCKMUX_FRAME_COMPRESSED set in its
+ * frames starts with the length of the uncompressed payload.
+ */
+struct _SockMuxCompressed {
+  guint32 length;
+  guchar data[0];
+} __attribute__((packed));
+
+typedef struct _SockMuxCompressed SockMuxCompressed;
+
 #endif /* _LIBSOCKMUX_GLIB_PROTOCOL_H_ */
@@ -19,43 +19,207 @@
  * MA 02110-1301 USA.
  */
 
+#include <errno.h>
+#include <string.h>
+
 #include <glib.h>
 #include <gio/gio.h>
+#include <gio/gfiledescriptorbased.h>
 
 #include "protocol.h"
+#include "pool-private.h"
 #include "receiver.h"
+#include "stats.h"
+#include "trace.h"
+
+#define MAX_PROTOCOL_VERSION 2
+#define DEFAULT_READ_BUFFER_SIZE 8192
+#define MAX_READ_BUFFER_SIZE (1024 * 1024)
+#define MAX_STACK_HANDLERS 32
+
+/* largest message a header found while resyncing may announce, without a max-message-size */
+#define MAX_RESYNC_MESSAGE_SIZE (64 * 1024 * 1024)
+
+/* largest frame of protocol version 2, each one is buffered as a whole */
+#define MAX_FRAME_SIZE (64 * 1024 * 1024)
 
+typedef struct _SockMuxReceiverCallback SockMuxReceiverCallback;
+typedef struct _SockMuxBuffer SockMuxBuffer;
+typedef struct _SockMuxLane SockMuxLane;
+typedef struct _SockMuxWindow SockMuxWindow;
+typedef struct _SockMuxJob SockMuxJob;
+typedef struct _SockMuxSerial SockMuxSerial;
+typedef struct _SockMuxPending SockMuxPending;
+
+/*
+ * A connected callback. Unfiltered and range callbacks live in the
+ * callbacks list; callbacks for a single message ID are indexed by
+ * that ID in the filtered_callbacks table, so dispatching does not
+ * depend on how many of them are connected. Streaming callbacks are
+ * kept in a table of their own, one per message ID, and batch callbacks
+ * in a list of their own.
+ *
+ * Callbacks are looked up under the callbacks mutex and called without
+ * it. Each call holds the callback by counting itself in running, which
+ * sockmux_receiver_disconnect() waits for. If it can't wait, it marks
+ * the callback orphaned and the last call frees it.
+ */
 struct _SockMuxReceiverCallback {
+  gulong handler_id;
+  guint first_id;
+  guint last_id;
   SockMuxReceiverCallbackFunc func;
+  gboolean streaming;
+  SockMuxReceiverStreamBeginFunc begin;
+  SockMuxReceiverStreamChunkFunc chunk;
+  SockMuxReceiverStreamEndFunc end;
+  gboolean batched;
+  SockMuxReceiverBatchFunc batch;
   gpointer userdata;
+  guint running;
+  gint disconnected;
+  gboolean orphaned;
 };
 
-struct _SockMuxReceiverFilteredCallback {
-  guint message_id;
-  SockMuxReceiverCallbackFunc func;
-  gpointer userdata;
+/*
+ * Input buffer with separate read and write cursors. Consuming a message
+ * only advances the read cursor; the remaining data is moved to the front
+ * only when there is not enough room left at the end for the next append.
+ */
+struct _SockMuxBuffer {
+  guint8 *data;
+  gsize   alloc;
+  gsize   start;
+  gsize   end;
 };
 
-typedef struct _SockMuxReceiverCallback SockMuxReceiverCallback;
-typedef struct _SockMuxReceiverFilteredCallback SockMuxReceiverFilteredCallback;
+/* the message being reassembled from the frames of one lane */
+struct _SockMuxLane {
+  guint       message_id;
+  GByteArray *data;
+  SockMuxReceiverCallback *stream_cb;
+  gboolean    streamed;
+  gboolean    dropped;
+  gboolean    compressed;
+  gboolean    credited;
+  guint32     length;
+};
+
+/*
+ * Receive window of a flow controlled message ID. Consumed payload is
+ * handed back to the peer as credit in batches of half a window, and
+ * what is left over at the end of each read. Messages the peer did not
+ * charge are not handed back; for manual windows, their size is kept in
+ * uncredited and taken off what the application consumes.
+ */
+struct _SockMuxWindow {
+  guint    window;
+  gboolean manual;
+  gsize    consumed;
+  gsize    uncredited;
+};
+
+/* a message handed to the dispatch pool */
+struct _SockMuxJob {
+  guint    message_id;
+  gsize    size;
+  gboolean credited;
+  guint8   data[0];
+};
+
+/*
+ * The messages of one ID waiting for the dispatch pool. As long as it
+ * is in the serials table, exactly one worker owns it, which keeps the
+ * messages of an ID in order.
+ */
+struct _SockMuxSerial {
+  guint  message_id;
+  GQueue jobs;
+};
+
+/* a message parsed by sockmux_receiver_read_message() but not returned yet */
+struct _SockMuxPending {
+  guint    message_id;
+  GBytes  *payload;
+  gboolean credited;
+};
 
 struct _SockMuxReceiver {
   GObject  parent;
 
   GInputStream  *input;
-  GByteArray    *input_buf;
-  guchar         input_read_buffer[8192];
+  SockMuxBuffer  input_buf;
+  guint          read_buffer_size;
+  gboolean       read_buffer_auto;
+  gsize          read_size;
+  gsize          missing;
   GCancellable  *input_cancellable;
   gboolean       handshake_received;
   guint          magic;
   guint          protocol_version;
 
   GSList        *callbacks;
-  GSList        *filtered_callbacks;
+  GHashTable    *filtered_callbacks;
+  GHashTable    *handlers;
+  gulong         last_handler_id;
+  gint           n_batch_callbacks;
+  GMutex         callbacks_mutex;
+  GCond          callbacks_cond;
+
+  /*
+   * Messages for the batch callbacks, collected while parsing a read.
+   * They point into the input buffer where possible, which is not
+   * touched until the next read; the others are copied.
+   */
+  GSList        *batch_callbacks;
+  GArray        *batch;
+  GArray        *batch_copies;
+
+  /* callbacks run in a thread pool, one message per ID at a time */
+  GThreadPool   *pool;
+  GHashTable    *serials;
+  GMutex         pool_mutex;
+
+  /* the message currently being streamed, the slot is under the callbacks mutex */
+  GHashTable    *streaming_callbacks;
+  SockMuxReceiverCallback *stream_cb;
+  guint          stream_id;
+  gsize          stream_remaining;
+
+  /* protocol version 2 */
+  SockMuxLane    lanes[SOCKMUX_FRAME_LANES];
+
+  /*
+   * flow control, credit is sent and received through the linked sender.
+   * Under the credit mutex, which is never held while calling into the
+   * sender, as callbacks may consume from any thread.
+   */
+  SockMuxSender *sender;
+  GHashTable    *windows;
+  guint          unreturned;
+  GMutex         credit_mutex;
+
+  /* compressed messages are inflated into a buffer of their own */
+  guint          peer_capabilities;
+  GConverter    *decompressor;
+  GByteArray    *inflated;
+
+  /* skip over corrupted input instead of stalling */
+  gboolean       resync;
+
+  /* blocking mode, messages are held for sockmux_receiver_read_message() */
+  gboolean       blocking;
+  GQueue         pending;
+
+  /* counters for sockmux_receiver_get_stats() */
+  SockMuxReceiverStats stats;
+  SockMuxIdTable *id_stats;
+  GMutex         stats_mutex;
+
   guint          max_message_size;
   guint          skip;
   gboolean       closing;
-  GMutex        *mutex;
+  GMutex         mutex;
 };
 
 static GObjectClass *parent_class = NULL;
@@ -72,8 +236,18 @@ static guint signals[SIGNAL_LAST];
 enum {
   PROP_0,
   PROP_MAX_MESSAGE_SIZE,
+  PROP_READ_BUFFER_SIZE,
+  PROP_READ_BUFFER_AUTO,
+  PROP_RESYNC,
+  PROP_DISPATCH_THREADS,
+  PROP_MESSAGES_RECEIVED,
+  PROP_BYTES_READ,
 };
 
+static void
+sockmux_receiver_set_dispatch_threads (SockMuxReceiver *receiver,
+                                       gint             n_threads);
+
 static void
 sockmux_receiver_get_property (GObject    *object,
                                guint       property_id,
@@ -89,6 +263,35 @@ sockmux_receiver_get_property (GObject    *object,
         g_value_set_int(value, receiver->max_message_size);
         break;
 
+      case PROP_READ_BUFFER_SIZE:
+        g_value_set_int(value, receiver->read_buffer_size);
+        break;
+
+      case PROP_READ_BUFFER_AUTO:
+        g_value_set_boolean(value, receiver->read_buffer_auto);
+        break;
+
+      case PROP_RESYNC:
+        g_value_set_boolean(value, receiver->resync);
+        break;
+
+      case PROP_DISPATCH_THREADS:
+        g_value_set_int(value, receiver->pool ?
+                               g_thread_pool_get_max_threads(receiver->pool) : 0);
+        break;
+
+      case PROP_MESSAGES_RECEIVED:
+        g_mutex_lock(&receiver->stats_mutex);
+        g_value_set_uint64(value, receiver->stats.messages_received);
+        g_mutex_unlock(&receiver->stats_mutex);
+        break;
+
+      case PROP_BYTES_READ:
+        g_mutex_lock(&receiver->stats_mutex);
+        g_value_set_uint64(value, receiver->stats.bytes_read);
+        g_mutex_unlock(&receiver->stats_mutex);
+        break;
+
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -109,277 +312,2223 @@ sockmux_receiver_set_property (GObject      *object,
         receiver->max_message_size = g_value_get_int(value);
         break;
 
+      case PROP_READ_BUFFER_SIZE:
+        receiver->read_buffer_size = MAX(g_value_get_int(value), 1);
+        receiver->read_size = receiver->read_buffer_size;
+        break;
+
+      case PROP_READ_BUFFER_AUTO:
+        receiver->read_buffer_auto = g_value_get_boolean(value);
+        receiver->read_size = receiver->read_buffer_size;
+        break;
+
+      case PROP_RESYNC:
+        receiver->resync = g_value_get_boolean(value);
+        break;
+
+      case PROP_DISPATCH_THREADS:
+        sockmux_receiver_set_dispatch_threads(receiver, g_value_get_int(value));
+        break;
+
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
 }
 
-static gint
-dispatch_message (SockMuxReceiver *receiver)
+#define sockmux_buffer_data(buf)   ((buf)->data + (buf)->start)
+#define sockmux_buffer_length(buf) ((buf)->end - (buf)->start)
+
+static guint8 *
+sockmux_buffer_reserve (SockMuxBuffer *buf,
+                        gsize          size)
 {
-  SockMuxMessage *msg;
-  guint32 msg_len, msg_id;
-  guint available_len;
-  GSList *iter;
+  gsize length = sockmux_buffer_length(buf);
 
-  msg = (SockMuxMessage *) receiver->input_buf->data;
-  available_len = receiver->input_buf->len;
+  if (buf->alloc - buf->end >= size)
+    return buf->data + buf->end;
 
-  if (available_len < sizeof(*msg))
-    return 0;
+  if (buf->start > 0)
+    {
+      memmove(buf->data, buf->data + buf->start, length);
+      buf->start = 0;
+      buf->end = length;
+    }
 
-  if (GUINT_FROM_BE(msg->magic) != receiver->magic)
+  if (buf->alloc - buf->end < size)
     {
-      g_signal_emit(receiver, signals[SIGNAL_PROTOCOL_ERROR], 0);
-      return 0;
+      buf->alloc = MAX(buf->alloc * 2, length + size);
+      buf->data = g_realloc(buf->data, buf->alloc);
     }
 
-  msg_len = GUINT_FROM_BE(msg->length);
-  msg_id = GUINT_FROM_BE(msg->message_id);
+  return buf->data + buf->end;
+}
 
-  if (receiver->max_message_size > 0 &&
-      msg_len > receiver->max_message_size)
-    {
-      g_signal_emit(receiver, signals[SIGNAL_MESSAGE_DROPPED], 0);
-      receiver->skip = msg_len;
+static void
+sockmux_buffer_append (SockMuxBuffer *buf,
+                       const guint8  *data,
+                       gsize          size)
+{
+  memcpy(sockmux_buffer_reserve(buf, size), data, size);
+  buf->end += size;
+}
 
-      return G_UNLIKELY(msg_len > available_len) ? available_len : msg_len;
-    }
+static void
+sockmux_buffer_consume (SockMuxBuffer *buf,
+                        gsize          size)
+{
+  buf->start += size;
 
-  if (available_len < msg_len + sizeof(*msg))
-    return 0;
+  if (buf->start == buf->end)
+    buf->start = buf->end = 0;
+}
 
-  /* walk the list of callbacks and see if anyone is interessted */
-  for (iter = receiver->callbacks; iter; iter = iter->next)
+/* give memory back after a burst of large messages, if the buffer is empty */
+static void
+sockmux_buffer_shrink (SockMuxBuffer *buf,
+                       gsize          size)
+{
+  if (buf->end > 0 || buf->alloc <= size)
+    return;
+
+  buf->data = g_realloc(buf->data, size);
+  buf->alloc = size;
+}
+
+static void
+sockmux_receiver_remove_callback (SockMuxReceiver         *receiver,
+                                  SockMuxReceiverCallback *cb)
+{
+  gpointer key = GUINT_TO_POINTER(cb->first_id);
+  GSList *list;
+
+  if (cb->streaming)
     {
-      SockMuxReceiverCallback *cb = iter->data;
-      cb->func(receiver, msg_id, msg->data, msg_len, cb->userdata);
+      g_hash_table_remove(receiver->streaming_callbacks, key);
+      return;
     }
-  
-  for (iter = receiver->filtered_callbacks; iter; iter = iter->next)
+
+  if (cb->batched)
     {
-      SockMuxReceiverFilteredCallback *cb = iter->data;
+      receiver->batch_callbacks = g_slist_remove(receiver->batch_callbacks, cb);
+      g_atomic_int_add(&receiver->n_batch_callbacks, -1);
+      return;
+    }
 
-      if (cb->message_id == msg_id)
-        cb->func(receiver, msg_id, msg->data, msg_len, cb->userdata);
+  if (cb->first_id != cb->last_id)
+    {
+      receiver->callbacks = g_slist_remove(receiver->callbacks, cb);
+      return;
     }
 
-  return msg_len + sizeof(*msg);
+  /* the table frees its lists, so take this one out while changing it */
+  list = g_hash_table_lookup(receiver->filtered_callbacks, key);
+  g_hash_table_steal(receiver->filtered_callbacks, key);
+  list = g_slist_remove(list, cb);
+
+  if (list)
+    g_hash_table_insert(receiver->filtered_callbacks, key, list);
 }
 
+/* counts a message that is passed on to the application, or streamed */
 static void
-dispatch_input (SockMuxReceiver *receiver)
+sockmux_receiver_count_message (SockMuxReceiver *receiver,
+                                guint            msg_id,
+                                gsize            size)
 {
-  gint len;
-
-  if (G_UNLIKELY(!receiver->handshake_received))
-    {
-      SockMuxHandshake *hs;
+  SOCKMUX_TRACE3(message, receiver, msg_id, size);
+
+  g_mutex_lock(&receiver->stats_mutex);
+  receiver->stats.messages_received++;
+  receiver->stats.bytes_received += size;
+  sockmux_stats_histogram_add(receiver->stats.size_histogram, size);
+  sockmux_stats_count_id(receiver->id_stats, msg_id, size);
+  g_mutex_unlock(&receiver->stats_mutex);
+}
 
-      if (receiver->input_buf->len < sizeof(*hs))
-        return;
+static void
+sockmux_receiver_count_callback_time (SockMuxReceiver *receiver,
+                                      gint64           start)
+{
+  gint64 usecs = g_get_monotonic_time() - start;
 
-      hs = (SockMuxHandshake *) receiver->input_buf->data;
+  g_mutex_lock(&receiver->stats_mutex);
+  receiver->stats.callback_time += usecs;
+  sockmux_stats_histogram_add(receiver->stats.callback_histogram, usecs);
+  g_mutex_unlock(&receiver->stats_mutex);
+}
 
-      if (GUINT_FROM_BE(hs->magic) != receiver->magic)
-        {
-          g_signal_emit(receiver, signals[SIGNAL_PROTOCOL_ERROR], 0);
-          return;
-        }
+static void
+sockmux_receiver_protocol_error (SockMuxReceiver *receiver)
+{
+  SOCKMUX_TRACE1(protocol_error, receiver);
 
-      receiver->protocol_version = GUINT_FROM_BE(hs->protocol_version);
-      receiver->handshake_received = TRUE;
-      g_byte_array_remove_range(receiver->input_buf, 0, sizeof(*hs));
-    }
+  g_mutex_lock(&receiver->stats_mutex);
+  receiver->stats.protocol_errors++;
+  g_mutex_unlock(&receiver->stats_mutex);
 
-  while ((len = dispatch_message(receiver)))
-    {
-      g_byte_array_remove_range(receiver->input_buf, 0, len);
-    }
+  g_signal_emit(receiver, signals[SIGNAL_PROTOCOL_ERROR], 0);
 }
 
 static void
-async_read_cb (GObject *source,
-               GAsyncResult *result,
-               gpointer data)
+sockmux_receiver_message_dropped (SockMuxReceiver *receiver)
 {
-  gsize len;
-  GError *error = NULL;
+  SOCKMUX_TRACE1(message_dropped, receiver);
+
+  g_mutex_lock(&receiver->stats_mutex);
+  receiver->stats.messages_dropped++;
+  g_mutex_unlock(&receiver->stats_mutex);
+
+  g_signal_emit(receiver, signals[SIGNAL_MESSAGE_DROPPED], 0);
+}
+
+/*
+ * The receivers whose callbacks run on the current thread, innermost
+ * first, so sockmux_receiver_disconnect() knows whether it was called
+ * from within one.
+ */
+typedef struct _SockMuxDispatch SockMuxDispatch;
+
+struct _SockMuxDispatch {
   SockMuxReceiver *receiver;
-  guint offset = 0;
+  SockMuxDispatch *outer;
+};
 
-  /* FIXME: is there really no clean solution to cancel a pending async operation!? */
-  if (g_input_stream_is_closed(G_INPUT_STREAM(source)))
-    return;
+static GPrivate current_dispatch;
 
-  receiver = SOCKMUX_RECEIVER(data);
-  g_return_if_fail(SOCKMUX_IS_RECEIVER(receiver));
+static void
+dispatch_begin (SockMuxReceiver *receiver,
+                SockMuxDispatch *dispatch)
+{
+  dispatch->receiver = receiver;
+  dispatch->outer = g_private_get(&current_dispatch);
+  g_private_set(&current_dispatch, dispatch);
+}
 
-  g_mutex_lock(receiver->mutex);
+static void
+dispatch_end (SockMuxDispatch *dispatch)
+{
+  g_private_set(&current_dispatch, dispatch->outer);
+}
 
-  if (receiver->closing)
-    goto exit;
+static gboolean
+sockmux_receiver_in_callback (SockMuxReceiver *receiver)
+{
+  SockMuxDispatch *dispatch;
 
-  len = g_input_stream_read_finish(receiver->input, result, &error);
-  if (len <= 0)
-    {
-      if (error)
-        {
-          g_critical("%s(): %s", __func__, error->message);
-          g_error_free (error);
-        }
+  for (dispatch = g_private_get(&current_dispatch); dispatch; dispatch = dispatch->outer)
+    if (dispatch->receiver == receiver)
+      return TRUE;
 
-      g_signal_emit(receiver, signals[SIGNAL_STREAM_END], 0);
-      goto exit;
-    }
+  return FALSE;
+}
 
-  if (receiver->skip > 0)
-    {
-      if (receiver->skip >= len)
-        {
-          receiver->skip -= len;
-          len = 0;
-        }
-      else
-        {
-          offset = receiver->skip;
-          len -= receiver->skip;
-          receiver->skip = 0;
-        }
-    }
+/* a callback that was disconnected is not called again, even while held */
+#define sockmux_callback_live(cb) (!g_atomic_int_get(&(cb)->disconnected))
 
-  if (len > 0)
-    {
-      g_byte_array_append(receiver->input_buf, receiver->input_read_buffer + offset, len);
-      dispatch_input(receiver);
-    }
+/* must be called with the callbacks mutex held */
+static void
+sockmux_receiver_release_locked (SockMuxReceiver         *receiver,
+                                 SockMuxReceiverCallback *cb)
+{
+  if (--cb->running > 0 || !cb->disconnected)
+    return;
 
-  g_input_stream_read_async(receiver->input,
-                            receiver->input_read_buffer,
-                            sizeof(receiver->input_read_buffer),
-                            G_PRIORITY_DEFAULT,
-                            receiver->input_cancellable,
-                            async_read_cb, receiver);
-exit:
-  g_mutex_unlock(receiver->mutex);
+  if (cb->orphaned)
+    g_free(cb);
+  else
+    g_cond_broadcast(&receiver->callbacks_cond);
 }
 
 static void
-sockmux_receiver_init (SockMuxReceiver *receiver)
+sockmux_receiver_release (SockMuxReceiver         *receiver,
+                          SockMuxReceiverCallback *cb)
 {
-  receiver->input_buf = g_byte_array_new();
-  receiver->input_cancellable = g_cancellable_new();
-  receiver->mutex = g_mutex_new();
+  if (cb == NULL)
+    return;
+
+  g_mutex_lock(&receiver->callbacks_mutex);
+  sockmux_receiver_release_locked(receiver, cb);
+  g_mutex_unlock(&receiver->callbacks_mutex);
 }
 
-void sockmux_receiver_connect (SockMuxReceiver *receiver,
-                               SockMuxReceiverCallbackFunc func,
-                               gpointer userdata)
+/*
+ * Holds the streaming callback in @slot for a call, if it is still
+ * there. With @take, the slot is cleared, for the end of a message.
+ */
+static SockMuxReceiverCallback *
+sockmux_receiver_hold_stream (SockMuxReceiver          *receiver,
+                              SockMuxReceiverCallback **slot,
+                              gboolean                  take)
 {
   SockMuxReceiverCallback *cb;
 
-  g_return_if_fail(SOCKMUX_IS_RECEIVER(receiver));
-  g_return_if_fail(func != NULL);
+  g_mutex_lock(&receiver->callbacks_mutex);
+  cb = *slot;
+  if (cb)
+    cb->running++;
+  if (take)
+    *slot = NULL;
+  g_mutex_unlock(&receiver->callbacks_mutex);
 
-  cb = g_new0(SockMuxReceiverCallback, 1);
+  return cb;
+}
 
-  if (cb == NULL)
-    {
-      g_error("Unable to allocate memory!?");
-      return;
-    }
+/* puts the streaming callback for @msg_id into @slot, and holds it for a call */
+static SockMuxReceiverCallback *
+sockmux_receiver_hold_streaming (SockMuxReceiver          *receiver,
+                                 guint                     msg_id,
+                                 SockMuxReceiverCallback **slot)
+{
+  SockMuxReceiverCallback *cb;
 
-  cb->func = func;
-  cb->userdata = userdata;
+  g_mutex_lock(&receiver->callbacks_mutex);
+  cb = g_hash_table_lookup(receiver->streaming_callbacks, GUINT_TO_POINTER(msg_id));
+  if (cb)
+    cb->running++;
+  *slot = cb;
+  g_mutex_unlock(&receiver->callbacks_mutex);
 
-  receiver->callbacks = g_slist_append(receiver->callbacks, cb);
+  return cb;
 }
 
-void sockmux_receiver_connect_filtered (SockMuxReceiver *receiver,
-                                        guint message_id,
-                                        SockMuxReceiverCallbackFunc func,
-                                        gpointer userdata)
+/*
+ * Calls the message callbacks for @msg_id, from the reading thread or a
+ * worker. They are held while the lock is dropped, so callbacks can be
+ * connected and disconnected from any thread in the meantime.
+ */
+static void
+sockmux_receiver_call (SockMuxReceiver *receiver,
+                       guint            msg_id,
+                       const guint8    *data,
+                       gsize            len)
 {
-  SockMuxReceiverFilteredCallback *cb;
+  SockMuxReceiverCallback **cbs;
+  SockMuxDispatch dispatch;
+  GSList *filtered, *iter;
+  guint i, n = 0, max;
+  gint64 start;
+
+  g_mutex_lock(&receiver->callbacks_mutex);
+  filtered = g_hash_table_lookup(receiver->filtered_callbacks,
+                                 GUINT_TO_POINTER(msg_id));
+
+  /* there are rarely more than a few, keep them on the stack then */
+  max = g_slist_length(receiver->callbacks) + g_slist_length(filtered);
+  cbs = max <= MAX_STACK_HANDLERS ?
+          g_newa(SockMuxReceiverCallback *, MAX(max, 1)) :
+          g_new(SockMuxReceiverCallback *, max);
 
-  g_return_if_fail(SOCKMUX_IS_RECEIVER(receiver));
-  g_return_if_fail(func != NULL);
+  for (iter = receiver->callbacks; iter; iter = iter->next)
+    {
+      SockMuxReceiverCallback *cb = iter->data;
 
-  cb = g_new0(SockMuxReceiverFilteredCallback, 1);
+      if (msg_id >= cb->first_id && msg_id <= cb->last_id)
+        {
+          cb->running++;
+          cbs[n++] = cb;
+        }
+    }
 
-  if (cb == NULL)
+  for (iter = filtered; iter; iter = iter->next)
     {
-      g_error("Unable to allocate memory!?");
-      return;
+      SockMuxReceiverCallback *cb = iter->data;
+
+      cb->running++;
+      cbs[n++] = cb;
     }
+  g_mutex_unlock(&receiver->callbacks_mutex);
 
-  cb->message_id = message_id;
-  cb->func = func;
-  cb->userdata = userdata;
+  SOCKMUX_TRACE2(callback_start, receiver, msg_id);
+  start = g_get_monotonic_time();
+  dispatch_begin(receiver, &dispatch);
+
+  for (i = 0; i < n; i++)
+    if (sockmux_callback_live(cbs[i]))
+      cbs[i]->func(receiver, msg_id, data, len, cbs[i]->userdata);
+
+  dispatch_end(&dispatch);
+  sockmux_receiver_count_callback_time(receiver, start);
+  SOCKMUX_TRACE2(callback_end, receiver, msg_id);
 
-  receiver->filtered_callbacks = g_slist_append(receiver->filtered_callbacks, cb);
+  g_mutex_lock(&receiver->callbacks_mutex);
+  for (i = 0; i < n; i++)
+    sockmux_receiver_release_locked(receiver, cbs[i]);
+  g_mutex_unlock(&receiver->callbacks_mutex);
+
+  if (max > MAX_STACK_HANDLERS)
+    g_free(cbs);
 }
 
-void sockmux_receiver_set_max_message_size (SockMuxReceiver *receiver,
-                                            guint max_message_size)
+/* a reference to the linked sender, to be called once the credit mutex is released */
+static SockMuxSender *
+sockmux_receiver_ref_sender_locked (SockMuxReceiver *receiver)
 {
-  g_return_if_fail(SOCKMUX_IS_RECEIVER(receiver));
-  receiver->max_message_size = max_message_size;
+  return receiver->sender ? g_object_ref(receiver->sender) : NULL;
 }
 
-SockMuxReceiver *sockmux_receiver_new (GInputStream *stream,
-                                       guint magic)
+/*
+ * Takes the consumed credit of a window for sending it to the peer.
+ * Must be called with the credit mutex held.
+ */
+static guint
+sockmux_receiver_take_window_locked (SockMuxReceiver *receiver,
+                                     SockMuxWindow   *window)
 {
-  SockMuxReceiver *receiver = g_object_new(SOCKMUX_TYPE_RECEIVER, NULL);
+  guint credit = window->consumed;
 
-  receiver->input = stream;
-  receiver->magic = magic;
+  if (receiver->sender == NULL || credit == 0)
+    return 0;
 
-  /* kick off initial read */
-  g_input_stream_read_async(receiver->input,
-                            receiver->input_read_buffer,
-                            sizeof(receiver->input_read_buffer),
-                            G_PRIORITY_DEFAULT,
-                            receiver->input_cancellable,
-                            async_read_cb, receiver);
+  window->consumed = 0;
+  receiver->unreturned--;
 
-  return receiver;
+  return credit;
 }
 
 static void
-sockmux_receiver_finalize (GObject *object)
+sockmux_receiver_add_consumed_locked (SockMuxReceiver *receiver,
+                                      SockMuxWindow   *window,
+                                      gsize            size)
 {
-  SockMuxReceiver *receiver = SOCKMUX_RECEIVER(object);
-
-  g_mutex_lock(receiver->mutex);
-  receiver->closing = TRUE;
-  g_cancellable_cancel(receiver->input_cancellable);
-  g_mutex_unlock(receiver->mutex);
+  if (size == 0)
+    return;
 
-  g_object_unref(receiver->input_cancellable);
-  receiver->input_cancellable = NULL;
+  if (window->consumed == 0)
+    receiver->unreturned++;
 
-  g_byte_array_free(receiver->input_buf, TRUE);
-  receiver->input_buf = NULL;
+  window->consumed += size;
+}
 
-  g_slist_free_full(receiver->callbacks, g_free);
-  g_slist_free_full(receiver->filtered_callbacks, g_free);
-  
-  g_mutex_free(receiver->mutex);
+static void
+sockmux_receiver_send_credit (SockMuxSender *sender,
+                              guint          message_id,
+                              guint          credit)
+{
+  if (sender && credit > 0)
+    sockmux_sender_send_credit(sender, message_id, credit);
 
-  G_OBJECT_CLASS (parent_class)->finalize (object);
+  if (sender)
+    g_object_unref(sender);
 }
 
+/*
+ * Gives credit for @size bytes of @message_id back to the peer, if the
+ * peer charged them (@credited). For manual windows, that is left to the
+ * application, except for messages it never saw.
+ */
 static void
-sockmux_receiver_class_init (SockMuxReceiverClass *klass)
+sockmux_receiver_return_credit (SockMuxReceiver *receiver,
+                                guint            message_id,
+                                gsize            size,
+                                gboolean         dispatched,
+                                gboolean         credited)
 {
-  GObjectClass *object_class;
-  GParamSpec *pspec;
+  SockMuxSender *sender = NULL;
+  SockMuxWindow *window;
+  guint credit = 0;
 
-  parent_class = (GObjectClass *) g_type_class_peek_parent (klass);
-  object_class = (GObjectClass *) klass;
+  if (size == 0 || !credited)
+    return;
 
-  object_class->get_property = sockmux_receiver_get_property;
+  g_mutex_lock(&receiver->credit_mutex);
+
+  window = g_hash_table_lookup(receiver->windows, GUINT_TO_POINTER(message_id));
+  if (window && !(window->manual && dispatched))
+    {
+      sockmux_receiver_add_consumed_locked(receiver, window, size);
+
+      if (window->consumed >= MAX(window->window / 2, 1))
+        {
+          credit = sockmux_receiver_take_window_locked(receiver, window);
+          sender = sockmux_receiver_ref_sender_locked(receiver);
+        }
+    }
+
+  g_mutex_unlock(&receiver->credit_mutex);
+
+  sockmux_receiver_send_credit(sender, message_id, credit);
+}
+
+/*
+ * Notes @size bytes the peer sent without charging them, before the
+ * application gets to see them. They are taken off what it consumes of
+ * a manual window.
+ */
+static void
+sockmux_receiver_uncredited (SockMuxReceiver *receiver,
+                             guint            message_id,
+                             gsize            size)
+{
+  SockMuxWindow *window;
+
+  g_mutex_lock(&receiver->credit_mutex);
+  window = g_hash_table_lookup(receiver->windows, GUINT_TO_POINTER(message_id));
+  if (window && window->manual)
+    window->uncredited += size;
+  g_mutex_unlock(&receiver->credit_mutex);
+}
+
+/*
+ * Hands back the rest of the consumed credit. Called once the input at
+ * hand is dealt with, so a peer that waits for it gets the whole window
+ * back eventually.
+ */
+static void
+sockmux_receiver_flush_credit (SockMuxReceiver *receiver)
+{
+  GHashTableIter iter;
+  gpointer key;
+  SockMuxWindow *window;
+  SockMuxSender *sender;
+  GArray *credits;
+  guint i;
+
+  g_mutex_lock(&receiver->credit_mutex);
+
+  if (receiver->unreturned == 0 || receiver->sender == NULL)
+    {
+      g_mutex_unlock(&receiver->credit_mutex);
+      return;
+    }
+
+  /* pairs of message ID and credit */
+  credits = g_array_sized_new(FALSE, FALSE, sizeof(guint), 2 * receiver->unreturned);
+
+  g_hash_table_iter_init(&iter, receiver->windows);
+  while (receiver->unreturned > 0 &&
+         g_hash_table_iter_next(&iter, &key, (gpointer *) &window))
+    {
+      guint pair[2] = { GPOINTER_TO_UINT(key), 0 };
+
+      pair[1] = sockmux_receiver_take_window_locked(receiver, window);
+      if (pair[1] > 0)
+        g_array_append_vals(credits, pair, 2);
+    }
+
+  sender = sockmux_receiver_ref_sender_locked(receiver);
+  g_mutex_unlock(&receiver->credit_mutex);
+
+  for (i = 0; i < credits->len; i += 2)
+    sockmux_sender_send_credit(sender, g_array_index(credits, guint, i),
+                               g_array_index(credits, guint, i + 1));
+
+  g_object_unref(sender);
+  g_array_free(credits, TRUE);
+}
+
+/* calls the callbacks for a message in a worker thread */
+static void
+sockmux_receiver_run_job (SockMuxReceiver *receiver,
+                          SockMuxJob      *job)
+{
+  sockmux_receiver_call(receiver, job->message_id, job->data, job->size);
+
+  sockmux_receiver_return_credit(receiver, job->message_id, job->size,
+                                 TRUE, job->credited);
+
+  sockmux_pool_free(job, sizeof(*job) + job->size);
+}
+
+#define POOL_BATCH 16
+
+/*
+ * Works through the messages of one ID. After a batch, the ID goes
+ * back to the end of the pool's queue, so a busy one can't starve the
+ * others if there are more IDs than threads.
+ */
+static void
+sockmux_receiver_pool_func (gpointer data,
+                            gpointer userdata)
+{
+  SockMuxSerial *serial = data;
+  SockMuxReceiver *receiver = SOCKMUX_RECEIVER(userdata);
+  SockMuxJob *job;
+  guint n;
+
+  for (n = 0; n < POOL_BATCH; n++)
+    {
+      g_mutex_lock(&receiver->pool_mutex);
+      job = g_queue_pop_head(&serial->jobs);
+      if (job == NULL)
+        {
+          g_hash_table_remove(receiver->serials,
+                              GUINT_TO_POINTER(serial->message_id));
+          g_mutex_unlock(&receiver->pool_mutex);
+
+          sockmux_receiver_flush_credit(receiver);
+
+          /* taken when the ID was scheduled */
+          g_object_unref(receiver);
+          return;
+        }
+      g_mutex_unlock(&receiver->pool_mutex);
+
+      sockmux_receiver_run_job(receiver, job);
+    }
+
+  g_thread_pool_push(receiver->pool, serial, NULL);
+}
+
+static void
+sockmux_receiver_post (SockMuxReceiver *receiver,
+                       guint            msg_id,
+                       const guint8    *data,
+                       guint            len,
+                       gboolean         credited)
+{
+  SockMuxJob *job = sockmux_pool_alloc(sizeof(*job) + len);
+  SockMuxSerial *serial;
+
+  job->message_id = msg_id;
+  job->size = len;
+  job->credited = credited;
+  memcpy(job->data, data, len);
+
+  g_mutex_lock(&receiver->pool_mutex);
+  serial = g_hash_table_lookup(receiver->serials, GUINT_TO_POINTER(msg_id));
+  if (serial == NULL)
+    {
+      serial = g_new0(SockMuxSerial, 1);
+      serial->message_id = msg_id;
+      g_hash_table_insert(receiver->serials, GUINT_TO_POINTER(msg_id), serial);
+      g_thread_pool_push(receiver->pool, serial, NULL);
+      g_object_ref(receiver);
+    }
+
+  g_queue_push_tail(&serial->jobs, job);
+  g_mutex_unlock(&receiver->pool_mutex);
+}
+
+static void
+sockmux_receiver_set_dispatch_threads (SockMuxReceiver *receiver,
+                                       gint             n_threads)
+{
+  /* once messages went to the pool, they have to keep doing so to stay in order */
+  if (receiver->pool && n_threads < 1)
+    g_warning("%s(): the dispatch pool can't be turned off once it is set up", __func__);
+  else if (receiver->pool)
+    g_thread_pool_set_max_threads(receiver->pool, n_threads, NULL);
+  else if (n_threads > 0)
+    receiver->pool = g_thread_pool_new(sockmux_receiver_pool_func, receiver,
+                                       n_threads, FALSE, NULL);
+}
+
+static void
+sockmux_receiver_batch_add (SockMuxReceiver *receiver,
+                            guint            msg_id,
+                            const guint8    *data,
+                            guint            len)
+{
+  SockMuxBuffer *buf = &receiver->input_buf;
+  SockMuxReceiverMessage msg;
+
+  msg.message_id = msg_id;
+  msg.data = data;
+  msg.size = len;
+
+  /* reassembled and inflated messages are overwritten by the next one */
+  if (len > 0 && (data < buf->data || data + len > buf->data + buf->end))
+    {
+      guint8 *copy = sockmux_pool_alloc(len);
+
+      memcpy(copy, data, len);
+      msg.data = copy;
+      g_array_append_val(receiver->batch_copies, msg);
+    }
+
+  g_array_append_val(receiver->batch, msg);
+}
+
+static void
+dispatch_batch (SockMuxReceiver *receiver)
+{
+  SockMuxReceiverCallback **cbs;
+  SockMuxDispatch dispatch;
+  GSList *iter;
+  guint i, n = 0, max;
+
+  g_mutex_lock(&receiver->callbacks_mutex);
+  max = g_slist_length(receiver->batch_callbacks);
+  cbs = max <= MAX_STACK_HANDLERS ?
+          g_newa(SockMuxReceiverCallback *, MAX(max, 1)) :
+          g_new(SockMuxReceiverCallback *, max);
+
+  for (iter = receiver->batch_callbacks; iter; iter = iter->next)
+    {
+      SockMuxReceiverCallback *cb = iter->data;
+
+      cb->running++;
+      cbs[n++] = cb;
+    }
+  g_mutex_unlock(&receiver->callbacks_mutex);
+
+  dispatch_begin(receiver, &dispatch);
+
+  for (i = 0; i < n; i++)
+    if (sockmux_callback_live(cbs[i]))
+      cbs[i]->batch(receiver,
+                    (const SockMuxReceiverMessage *) receiver->batch->data,
+                    receiver->batch->len, cbs[i]->userdata);
+
+  dispatch_end(&dispatch);
+
+  g_mutex_lock(&receiver->callbacks_mutex);
+  for (i = 0; i < n; i++)
+    sockmux_receiver_release_locked(receiver, cbs[i]);
+  g_mutex_unlock(&receiver->callbacks_mutex);
+
+  if (max > MAX_STACK_HANDLERS)
+    g_free(cbs);
+
+  for (i = 0; i < receiver->batch_copies->len; i++)
+    {
+      SockMuxReceiverMessage *msg = &g_array_index(receiver->batch_copies,
+                                                   SockMuxReceiverMessage, i);
+
+      sockmux_pool_free((gpointer) msg->data, msg->size);
+    }
+
+  g_array_set_size(receiver->batch_copies, 0);
+  g_array_set_size(receiver->batch, 0);
+}
+
+static void
+dispatch_callbacks (SockMuxReceiver *receiver,
+                    guint            msg_id,
+                    const guint8    *data,
+                    guint            len,
+                    gboolean         credited)
+{
+  sockmux_receiver_count_message(receiver, msg_id, len);
+
+  if (!credited)
+    sockmux_receiver_uncredited(receiver, msg_id, len);
+
+  if (receiver->blocking)
+    {
+      SockMuxPending *pending = g_new(SockMuxPending, 1);
+
+      pending->message_id = msg_id;
+      pending->payload = g_bytes_new(data, len);
+      pending->credited = credited;
+      g_queue_push_tail(&receiver->pending, pending);
+      return;
+    }
+
+  if (g_atomic_int_get(&receiver->n_batch_callbacks) > 0)
+    sockmux_receiver_batch_add(receiver, msg_id, data, len);
+
+  if (receiver->pool)
+    {
+      sockmux_receiver_post(receiver, msg_id, data, len, credited);
+      return;
+    }
+
+  sockmux_receiver_call(receiver, msg_id, data, len);
+  sockmux_receiver_return_credit(receiver, msg_id, len, TRUE, credited);
+}
+
+/* hands the next piece of a streamed message body to its callback */
+static guint
+dispatch_stream (SockMuxReceiver *receiver,
+                 const guint8    *data,
+                 guint            available_len)
+{
+  SockMuxReceiverCallback *cb;
+  SockMuxDispatch dispatch;
+  guint len = MIN(receiver->stream_remaining, available_len);
+
+  cb = sockmux_receiver_hold_stream(receiver, &receiver->stream_cb, FALSE);
+  dispatch_begin(receiver, &dispatch);
+
+  if (cb && len > 0)
+    {
+      sockmux_receiver_uncredited(receiver, receiver->stream_id, len);
+      cb->chunk(receiver, receiver->stream_id, data, len, cb->userdata);
+    }
+
+  receiver->stream_remaining -= len;
+  sockmux_receiver_return_credit(receiver, receiver->stream_id, len, cb != NULL, FALSE);
+  sockmux_receiver_release(receiver, cb);
+
+  /* the callback might have disconnected itself in the meantime */
+  if (receiver->stream_remaining == 0)
+    {
+      cb = sockmux_receiver_hold_stream(receiver, &receiver->stream_cb, TRUE);
+      if (cb && cb->end)
+        cb->end(receiver, receiver->stream_id, cb->userdata);
+      sockmux_receiver_release(receiver, cb);
+    }
+
+  dispatch_end(&dispatch);
+
+  return len;
+}
+
+/* returns FALSE if the data does not inflate to exactly @length bytes */
+static gboolean
+sockmux_receiver_inflate (SockMuxReceiver *receiver,
+                          const guint8    *data,
+                          gsize            size,
+                          gsize            length)
+{
+  GConverterResult res;
+  gsize in_pos = 0, out_pos = 0, bytes_read, bytes_written;
+
+  if (receiver->decompressor == NULL)
+    receiver->decompressor = G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+
+  g_converter_reset(receiver->decompressor);
+  g_byte_array_set_size(receiver->inflated, length);
+
+  do
+    {
+      res = g_converter_convert(receiver->decompressor,
+                                data + in_pos, size - in_pos,
+                                receiver->inflated->data + out_pos, length - out_pos,
+                                G_CONVERTER_INPUT_AT_END,
+                                &bytes_read, &bytes_written, NULL);
+      in_pos += bytes_read;
+      out_pos += bytes_written;
+    }
+  while (res == G_CONVERTER_CONVERTED && (bytes_read > 0 || bytes_written > 0));
+
+  return res == G_CONVERTER_FINISHED && out_pos == length;
+}
+
+/* hands a complete message that was collected from frames on */
+static void
+dispatch_lane (SockMuxReceiver *receiver,
+               SockMuxLane     *lane,
+               const guint8    *data,
+               guint            len)
+{
+  SockMuxReceiverCallback *cb;
+  SockMuxDispatch dispatch;
+
+  if (!lane->streamed)
+    {
+      dispatch_callbacks(receiver, lane->message_id, data, len, lane->credited);
+      return;
+    }
+
+  /* only compressed messages are not streamed frame by frame */
+  cb = sockmux_receiver_hold_stream(receiver, &lane->stream_cb, TRUE);
+  if (cb == NULL)
+    {
+      /* disconnected in the meantime */
+      sockmux_receiver_return_credit(receiver, lane->message_id, len,
+                                     FALSE, lane->credited);
+      return;
+    }
+
+  if (!lane->credited)
+    sockmux_receiver_uncredited(receiver, lane->message_id, len);
+
+  dispatch_begin(receiver, &dispatch);
+
+  if (cb->begin)
+    cb->begin(receiver, lane->message_id, len, cb->userdata);
+
+  if (sockmux_callback_live(cb) && len > 0)
+    cb->chunk(receiver, lane->message_id, data, len, cb->userdata);
+
+  if (sockmux_callback_live(cb) && cb->end)
+    cb->end(receiver, lane->message_id, cb->userdata);
+
+  dispatch_end(&dispatch);
+  sockmux_receiver_release(receiver, cb);
+
+  sockmux_receiver_return_credit(receiver, lane->message_id, len, TRUE, lane->credited);
+}
+
+/* a header can only be judged once all of it has arrived */
+static gboolean
+sockmux_receiver_plausible_header (SockMuxReceiver *receiver,
+                                   const guint8    *data)
+{
+  const SockMuxFrame *frame = (const SockMuxFrame *) data;
+
+  /*
+   * Version 1 headers have nothing to check but the length, and a wrong
+   * one would make a stretch of garbage pass for a message body.
+   * Streamed messages may be of any size.
+   */
+  if (receiver->protocol_version < 2)
+    {
+      const SockMuxMessage *msg = (const SockMuxMessage *) data;
+      guint32 msg_id = GUINT_FROM_BE(msg->message_id);
+      guint max = receiver->max_message_size > 0 ?
+                    receiver->max_message_size : MAX_RESYNC_MESSAGE_SIZE;
+      gboolean streamed;
+
+      if (GUINT_FROM_BE(msg->length) <= max)
+        return TRUE;
+
+      g_mutex_lock(&receiver->callbacks_mutex);
+      streamed = g_hash_table_lookup(receiver->streaming_callbacks,
+                                     GUINT_TO_POINTER(msg_id)) != NULL;
+      g_mutex_unlock(&receiver->callbacks_mutex);
+
+      return streamed;
+    }
+
+  return frame->lane < SOCKMUX_FRAME_LANES &&
+         frame->reserved == 0 &&
+         (frame->flags & ~(SOCKMUX_FRAME_BEGIN | SOCKMUX_FRAME_END |
+                           SOCKMUX_FRAME_CONTROL | SOCKMUX_FRAME_COMPRESSED |
+                           SOCKMUX_FRAME_CREDITED)) == 0 &&
+         GUINT_FROM_BE(frame->length) <= GUINT_FROM_BE(frame->total_length) &&
+         GUINT_FROM_BE(frame->length) <= MAX_FRAME_SIZE;
+}
+
+/*
+ * Returns the offset of the first candidate for a header after the
+ * start of @data, or @size if there is none. A candidate that is cut
+ * off at the end of @data is returned as well, it is checked again once
+ * the rest of it has been read. memchr() is vectorised by the C library,
+ * so this runs at memory speed through long stretches of garbage.
+ */
+static gsize
+sockmux_receiver_find_header (SockMuxReceiver *receiver,
+                              const guint8    *data,
+                              gsize            size)
+{
+  guint32 magic = GUINT32_TO_BE(receiver->magic);
+  const guint8 *m = (const guint8 *) &magic;
+  const guint8 *p = data + 1, *end = data + size;
+  gsize header_size;
+
+  header_size = receiver->protocol_version >= 2 ?
+                  sizeof(SockMuxFrame) : sizeof(SockMuxMessage);
+
+  while (p < end && (p = memchr(p, m[0], end - p)))
+    {
+      gsize n = MIN((gsize) (end - p), sizeof(magic));
+
+      if (memcmp(p, m, n) == 0 &&
+          ((gsize) (end - p) < header_size ||
+           sockmux_receiver_plausible_header(receiver, p)))
+        return p - data;
+
+      p++;
+    }
+
+  return size;
+}
+
+/*
+ * Called when the front of the input buffer does not hold a valid
+ * header. Without resync, nothing is consumed and the connection is
+ * stuck. With it, the input up to the next plausible header is dropped,
+ * along with all messages of protocol version 2 that were in progress.
+ * Streaming callbacks of such messages do not see their end.
+ */
+static gint
+dispatch_garbage (SockMuxReceiver *receiver)
+{
+  gsize len;
+  guint i;
+
+  sockmux_receiver_protocol_error(receiver);
+
+  if (!receiver->resync || receiver->closing)
+    return 0;
+
+  g_mutex_lock(&receiver->callbacks_mutex);
+  for (i = 0; i < SOCKMUX_FRAME_LANES; i++)
+    {
+      SockMuxLane *lane = &receiver->lanes[i];
+
+      lane->stream_cb = NULL;
+      lane->streamed = FALSE;
+      lane->dropped = TRUE;
+      g_byte_array_set_size(lane->data, 0);
+    }
+  g_mutex_unlock(&receiver->callbacks_mutex);
+
+  len = sockmux_receiver_find_header(receiver,
+                                     sockmux_buffer_data(&receiver->input_buf),
+                                     sockmux_buffer_length(&receiver->input_buf));
+  g_mutex_lock(&receiver->stats_mutex);
+  receiver->stats.skipped_bytes += len;
+  g_mutex_unlock(&receiver->stats_mutex);
+
+  return len;
+}
+
+/*
+ * Whether the message starting with @frame is larger than allowed.
+ * Checked before the frame is buffered, so a peer can't make the
+ * receiver allocate what it announces. The uncompressed length of a
+ * compressed message, which is what the peer charged, is stored in
+ * @length. Returns FALSE as long as that is not there yet, and sets
+ * @missing to what has to be read.
+ */
+static gboolean
+sockmux_receiver_frame_too_large (SockMuxReceiver *receiver,
+                                  SockMuxFrame    *frame,
+                                  guint            available_len,
+                                  guint32         *length,
+                                  gsize           *missing)
+{
+  guint32 len = GUINT_FROM_BE(frame->length);
+  guint32 total_len = GUINT_FROM_BE(frame->total_length);
+  gboolean streamed;
+
+  if (receiver->max_message_size == 0)
+    return FALSE;
+
+  *length = total_len;
+
+  if ((frame->flags & SOCKMUX_FRAME_COMPRESSED) && len >= sizeof(SockMuxCompressed))
+    {
+      SockMuxCompressed *hdr = (SockMuxCompressed *) frame->data;
+
+      if (available_len < sizeof(*frame) + sizeof(*hdr))
+        {
+          *missing = sizeof(*frame) + sizeof(*hdr) - available_len;
+          return FALSE;
+        }
+
+      *length = GUINT_FROM_BE(hdr->length);
+    }
+
+  if (total_len <= receiver->max_message_size &&
+      *length <= receiver->max_message_size)
+    return FALSE;
+
+  g_mutex_lock(&receiver->callbacks_mutex);
+  streamed = g_hash_table_lookup(receiver->streaming_callbacks,
+                                 GUINT_TO_POINTER(GUINT_FROM_BE(frame->message_id))) != NULL;
+  g_mutex_unlock(&receiver->callbacks_mutex);
+
+  return !streamed;
+}
+
+/*
+ * Drops a frame of a message that is not passed on, without buffering
+ * its body, which is skipped while it is read. Credit is returned per
+ * frame, or for the whole message with the last frame of a compressed
+ * one.
+ */
+static gint
+sockmux_receiver_skip_frame (SockMuxReceiver *receiver,
+                             SockMuxLane     *lane,
+                             SockMuxFrame    *frame)
+{
+  guint32 len = GUINT_FROM_BE(frame->length);
+  guint32 msg_id = GUINT_FROM_BE(frame->message_id);
+
+  if (!lane->compressed)
+    sockmux_receiver_return_credit(receiver, msg_id, len, FALSE,
+                                   !!(frame->flags & SOCKMUX_FRAME_CREDITED));
+  else if (frame->flags & SOCKMUX_FRAME_END)
+    sockmux_receiver_return_credit(receiver, msg_id, lane->length, FALSE, lane->credited);
+
+  receiver->skip = len;
+
+  return sizeof(*frame);
+}
+
+/*
+ * Frames are passed on as they arrive for streamed messages, and
+ * collected per lane for everything else. A message that fits into a
+ * single frame is dispatched straight from the input buffer. Compressed
+ * messages are always collected and inflated once complete.
+ */
+static gint
+dispatch_frame (SockMuxReceiver *receiver)
+{
+  SockMuxFrame *frame;
+  SockMuxLane *lane;
+  SockMuxReceiverCallback *cb;
+  SockMuxDispatch dispatch;
+  guint32 len, total_len, msg_id;
+  guint available_len;
+  gboolean credited;
+  guint32 length = 0;
+  gsize missing = 0;
+
+  frame = (SockMuxFrame *) sockmux_buffer_data(&receiver->input_buf);
+  available_len = sockmux_buffer_length(&receiver->input_buf);
+
+  /* drop the body of a frame that is not passed on */
+  if (receiver->skip > 0)
+    {
+      guint skip = MIN(receiver->skip, available_len);
+      receiver->skip -= skip;
+      return skip;
+    }
+
+  if (available_len < sizeof(*frame))
+    return 0;
+
+  if (GUINT_FROM_BE(frame->magic) != receiver->magic ||
+      !sockmux_receiver_plausible_header(receiver, (guint8 *) frame))
+    return dispatch_garbage(receiver);
+
+  len = GUINT_FROM_BE(frame->length);
+  total_len = GUINT_FROM_BE(frame->total_length);
+  msg_id = GUINT_FROM_BE(frame->message_id);
+  credited = !!(frame->flags & SOCKMUX_FRAME_CREDITED);
+  lane = &receiver->lanes[frame->lane];
+
+  if ((frame->flags & (SOCKMUX_FRAME_BEGIN | SOCKMUX_FRAME_CONTROL)) == SOCKMUX_FRAME_BEGIN)
+    {
+      if (sockmux_receiver_frame_too_large(receiver, frame, available_len,
+                                           &length, &missing))
+        {
+          sockmux_receiver_message_dropped(receiver);
+
+          g_mutex_lock(&receiver->callbacks_mutex);
+          lane->stream_cb = NULL;
+          g_mutex_unlock(&receiver->callbacks_mutex);
+
+          lane->message_id = msg_id;
+          lane->dropped = TRUE;
+          lane->streamed = FALSE;
+          lane->compressed = !!(frame->flags & SOCKMUX_FRAME_COMPRESSED);
+          lane->credited = credited;
+          lane->length = length;
+          g_byte_array_set_size(lane->data, 0);
+
+          return sockmux_receiver_skip_frame(receiver, lane, frame);
+        }
+
+      if (missing > 0)
+        {
+          receiver->missing = missing;
+          return 0;
+        }
+    }
+  else if (!(frame->flags & SOCKMUX_FRAME_CONTROL) &&
+           lane->dropped && lane->message_id == msg_id)
+    return sockmux_receiver_skip_frame(receiver, lane, frame);
+  else if ((frame->flags & SOCKMUX_FRAME_CONTROL) && len != sizeof(SockMuxCredit))
+    return dispatch_garbage(receiver);
+
+  if (available_len < len + sizeof(*frame))
+    {
+      receiver->missing = len + sizeof(*frame) - available_len;
+      return 0;
+    }
+
+  if (frame->flags & SOCKMUX_FRAME_CONTROL)
+    {
+      SockMuxCredit *credit = (SockMuxCredit *) frame->data;
+      SockMuxSender *sender;
+
+      g_mutex_lock(&receiver->credit_mutex);
+      sender = sockmux_receiver_ref_sender_locked(receiver);
+      g_mutex_unlock(&receiver->credit_mutex);
+
+      if (sender)
+        {
+          sockmux_sender_add_credit(sender, msg_id, GUINT_FROM_BE(credit->credit));
+          g_object_unref(sender);
+        }
+
+      return len + sizeof(*frame);
+    }
+
+  if (frame->flags & SOCKMUX_FRAME_BEGIN)
+    {
+      lane->message_id = msg_id;
+      lane->dropped = FALSE;
+      lane->compressed = !!(frame->flags & SOCKMUX_FRAME_COMPRESSED);
+      lane->credited = credited;
+      lane->length = total_len;
+      g_byte_array_set_size(lane->data, 0);
+
+      if (lane->compressed)
+        {
+          SockMuxCompressed *hdr = (SockMuxCompressed *) frame->data;
+
+          if (len < sizeof(*hdr))
+            {
+              lane->dropped = TRUE;
+              return dispatch_garbage(receiver);
+            }
+
+          lane->length = GUINT_FROM_BE(hdr->length);
+        }
+
+      cb = sockmux_receiver_hold_streaming(receiver, msg_id, &lane->stream_cb);
+      lane->streamed = cb != NULL;
+
+      if (lane->streamed)
+        {
+          sockmux_receiver_count_message(receiver, msg_id, lane->length);
+
+          if (!lane->compressed && cb->begin)
+            {
+              dispatch_begin(receiver, &dispatch);
+              cb->begin(receiver, msg_id, total_len, cb->userdata);
+              dispatch_end(&dispatch);
+            }
+
+          sockmux_receiver_release(receiver, cb);
+        }
+      else if (receiver->max_message_size > 0 &&
+               lane->length > receiver->max_message_size)
+        {
+          sockmux_receiver_message_dropped(receiver);
+          lane->dropped = TRUE;
+        }
+      else if ((frame->flags & SOCKMUX_FRAME_END) && !lane->compressed)
+        {
+          dispatch_callbacks(receiver, msg_id, frame->data, len, credited);
+          return len + sizeof(*frame);
+        }
+    }
+  else if (lane->message_id != msg_id)
+    return dispatch_garbage(receiver);
+
+  if (lane->streamed && !lane->compressed)
+    {
+      /* the rest of the message is dropped once the callback is disconnected */
+      cb = sockmux_receiver_hold_stream(receiver, &lane->stream_cb, FALSE);
+      dispatch_begin(receiver, &dispatch);
+
+      if (cb && !credited)
+        sockmux_receiver_uncredited(receiver, msg_id, len);
+
+      if (cb && len > 0)
+        cb->chunk(receiver, msg_id, frame->data, len, cb->userdata);
+
+      sockmux_receiver_return_credit(receiver, msg_id, len, cb != NULL, credited);
+      sockmux_receiver_release(receiver, cb);
+
+      /* the callback might have disconnected itself in the meantime */
+      if (frame->flags & SOCKMUX_FRAME_END)
+        {
+          cb = sockmux_receiver_hold_stream(receiver, &lane->stream_cb, TRUE);
+          if (cb && cb->end)
+            cb->end(receiver, msg_id, cb->userdata);
+          sockmux_receiver_release(receiver, cb);
+        }
+
+      dispatch_end(&dispatch);
+    }
+  else if (!lane->dropped)
+    {
+      g_byte_array_append(lane->data, frame->data, len);
+
+      if (frame->flags & SOCKMUX_FRAME_END)
+        {
+          if (!lane->compressed)
+            dispatch_lane(receiver, lane, lane->data->data, lane->data->len);
+          else if (sockmux_receiver_inflate(receiver,
+                                            lane->data->data + sizeof(SockMuxCompressed),
+                                            lane->data->len - sizeof(SockMuxCompressed),
+                                            lane->length))
+            dispatch_lane(receiver, lane, receiver->inflated->data, lane->length);
+          else
+            {
+              sockmux_receiver_protocol_error(receiver);
+              sockmux_receiver_return_credit(receiver, msg_id, lane->length,
+                                             FALSE, lane->credited);
+
+              g_mutex_lock(&receiver->callbacks_mutex);
+              lane->stream_cb = NULL;
+              g_mutex_unlock(&receiver->callbacks_mutex);
+            }
+
+          /* don't hold on to the memory of a large message */
+          if (lane->data->len > DEFAULT_READ_BUFFER_SIZE)
+            {
+              g_byte_array_unref(lane->data);
+              lane->data = g_byte_array_new();
+            }
+          else
+            g_byte_array_set_size(lane->data, 0);
+
+          if (receiver->inflated->len > DEFAULT_READ_BUFFER_SIZE)
+            {
+              g_byte_array_unref(receiver->inflated);
+              receiver->inflated = g_byte_array_new();
+            }
+        }
+    }
+  else if (!lane->compressed)
+    sockmux_receiver_return_credit(receiver, msg_id, len, FALSE, credited);
+  else if (frame->flags & SOCKMUX_FRAME_END)
+    sockmux_receiver_return_credit(receiver, msg_id, lane->length, FALSE, lane->credited);
+
+  return len + sizeof(*frame);
+}
+
+static gint
+dispatch_message (SockMuxReceiver *receiver)
+{
+  SockMuxMessage *msg;
+  guint32 msg_len, msg_id;
+  guint available_len;
+  SockMuxReceiverCallback *cb;
+  SockMuxDispatch dispatch;
+
+  msg = (SockMuxMessage *) sockmux_buffer_data(&receiver->input_buf);
+  available_len = sockmux_buffer_length(&receiver->input_buf);
+  receiver->missing = 0;
+
+  if (receiver->protocol_version >= 2)
+    return dispatch_frame(receiver);
+
+  /* drop the body of a message that was too large */
+  if (receiver->skip > 0)
+    {
+      guint len = MIN(receiver->skip, available_len);
+      receiver->skip -= len;
+      return len;
+    }
+
+  if (receiver->stream_remaining > 0)
+    return available_len ? dispatch_stream(receiver, (guint8 *) msg, available_len) : 0;
+
+  if (available_len < sizeof(*msg))
+    return 0;
+
+  if (GUINT_FROM_BE(msg->magic) != receiver->magic)
+    return dispatch_garbage(receiver);
+
+  msg_len = GUINT_FROM_BE(msg->length);
+  msg_id = GUINT_FROM_BE(msg->message_id);
+
+  /* streamed messages are passed on as they arrive, regardless of their size */
+  cb = sockmux_receiver_hold_streaming(receiver, msg_id, &receiver->stream_cb);
+  if (cb)
+    {
+      receiver->stream_id = msg_id;
+      receiver->stream_remaining = msg_len;
+      sockmux_receiver_count_message(receiver, msg_id, msg_len);
+
+      dispatch_begin(receiver, &dispatch);
+      if (cb->begin)
+        cb->begin(receiver, msg_id, msg_len, cb->userdata);
+      dispatch_end(&dispatch);
+      sockmux_receiver_release(receiver, cb);
+
+      if (msg_len == 0)
+        dispatch_stream(receiver, NULL, 0);
+
+      return sizeof(*msg);
+    }
+
+  if (receiver->max_message_size > 0 &&
+      msg_len > receiver->max_message_size)
+    {
+      sockmux_receiver_message_dropped(receiver);
+      sockmux_receiver_return_credit(receiver, msg_id, msg_len, FALSE, FALSE);
+      receiver->skip = msg_len;
+
+      return sizeof(*msg);
+    }
+
+  if (available_len < msg_len + sizeof(*msg))
+    {
+      receiver->missing = msg_len + sizeof(*msg) - available_len;
+      return 0;
+    }
+
+  dispatch_callbacks(receiver, msg_id, msg->data, msg_len, FALSE);
+
+  return msg_len + sizeof(*msg);
+}
+
+static void
+dispatch_input (SockMuxReceiver *receiver)
+{
+  gint len;
+
+  if (G_UNLIKELY(!receiver->handshake_received))
+    {
+      SockMuxHandshake *hs;
+      SockMuxSender *sender;
+
+      if (sockmux_buffer_length(&receiver->input_buf) < sizeof(*hs))
+        return;
+
+      hs = (SockMuxHandshake *) sockmux_buffer_data(&receiver->input_buf);
+
+      if (GUINT_FROM_BE(hs->magic) != receiver->magic)
+        {
+          sockmux_receiver_protocol_error(receiver);
+          return;
+        }
+
+      receiver->protocol_version = GUINT_FROM_BE(hs->protocol_version);
+      if (receiver->protocol_version > MAX_PROTOCOL_VERSION)
+        {
+          sockmux_receiver_protocol_error(receiver);
+          return;
+        }
+
+      if (receiver->protocol_version >= 2)
+        {
+          SockMuxHandshake2 *hs2 = (SockMuxHandshake2 *) hs;
+
+          if (sockmux_buffer_length(&receiver->input_buf) < sizeof(*hs2))
+            return;
+
+          receiver->peer_capabilities = GUINT_FROM_BE(hs2->capabilities);
+          sockmux_buffer_consume(&receiver->input_buf, sizeof(*hs2));
+        }
+      else
+        sockmux_buffer_consume(&receiver->input_buf, sizeof(*hs));
+
+      /* together with the sender, so sockmux_receiver_set_sender() sees either */
+      g_mutex_lock(&receiver->credit_mutex);
+      receiver->handshake_received = TRUE;
+      sender = sockmux_receiver_ref_sender_locked(receiver);
+      g_mutex_unlock(&receiver->credit_mutex);
+
+      if (sender)
+        {
+          if (receiver->protocol_version >= 2)
+            sockmux_sender_set_peer_capabilities(sender, receiver->peer_capabilities);
+
+          g_object_unref(sender);
+        }
+    }
+
+  while ((len = dispatch_message(receiver)))
+    {
+      sockmux_buffer_consume(&receiver->input_buf, len);
+    }
+
+  if (receiver->batch->len > 0)
+    dispatch_batch(receiver);
+
+  sockmux_receiver_flush_credit(receiver);
+}
+
+static void
+async_read_cb (GObject *source,
+               GAsyncResult *result,
+               gpointer data);
+
+static void
+sockmux_receiver_count_read (SockMuxReceiver *receiver,
+                             gsize            len)
+{
+  SOCKMUX_TRACE2(read_done, receiver, len);
+
+  g_mutex_lock(&receiver->stats_mutex);
+  receiver->stats.bytes_read += len;
+  receiver->stats.read_calls++;
+  g_mutex_unlock(&receiver->stats_mutex);
+}
+
+/*
+ * The size of the next read, which fetches the rest of a partially
+ * received large message in one go, up to the largest read buffer.
+ */
+static gsize
+sockmux_receiver_read_size (SockMuxReceiver *receiver)
+{
+  gsize size = receiver->read_size;
+
+  if (receiver->missing > size)
+    size = MIN(receiver->missing, MAX(receiver->read_buffer_size, MAX_READ_BUFFER_SIZE));
+
+  return size;
+}
+
+static gsize
+sockmux_receiver_next_read_size (SockMuxReceiver *receiver,
+                                 gsize            last_len)
+{
+  gsize size;
+
+  if (!receiver->read_buffer_auto)
+    return receiver->read_buffer_size;
+
+  /*
+   * Grow while reads come back full, shrink back to the configured size
+   * once the peer goes quiet.
+   */
+  if (last_len >= receiver->read_size)
+    receiver->read_size *= 2;
+  else if (last_len < receiver->read_size / 4)
+    receiver->read_size /= 2;
+
+  receiver->read_size = CLAMP(receiver->read_size,
+                              receiver->read_buffer_size,
+                              MAX(receiver->read_buffer_size, MAX_READ_BUFFER_SIZE));
+
+  size = sockmux_receiver_read_size(receiver);
+
+  if (sockmux_buffer_length(&receiver->input_buf) == 0)
+    sockmux_buffer_shrink(&receiver->input_buf, size);
+
+  return size;
+}
+
+static void
+sockmux_receiver_read (SockMuxReceiver *receiver,
+                       gsize            size)
+{
+  g_input_stream_read_async(receiver->input,
+                            sockmux_buffer_reserve(&receiver->input_buf, size),
+                            size,
+                            G_PRIORITY_DEFAULT,
+                            receiver->input_cancellable,
+                            async_read_cb, receiver);
+}
+
+static void
+async_read_cb (GObject *source,
+               GAsyncResult *result,
+               gpointer data)
+{
+  gssize len;
+  GError *error = NULL;
+  SockMuxReceiver *receiver;
+
+  /* FIXME: is there really no clean solution to cancel a pending async operation!? */
+  if (g_input_stream_is_closed(G_INPUT_STREAM(source)))
+    return;
+
+  receiver = SOCKMUX_RECEIVER(data);
+  g_return_if_fail(SOCKMUX_IS_RECEIVER(receiver));
+
+  g_mutex_lock(&receiver->mutex);
+
+  if (receiver->closing)
+    goto exit;
+
+  len = g_input_stream_read_finish(receiver->input, result, &error);
+  if (len <= 0)
+    {
+      if (error)
+        {
+          g_critical("%s(): %s", __func__, error->message);
+          g_error_free (error);
+        }
+
+      g_signal_emit(receiver, signals[SIGNAL_STREAM_END], 0);
+      goto exit;
+    }
+
+  sockmux_receiver_count_read(receiver, len);
+
+  /* the data was read straight into the free space of the input buffer */
+  receiver->input_buf.end += len;
+  dispatch_input(receiver);
+
+  sockmux_receiver_read(receiver, sockmux_receiver_next_read_size(receiver, len));
+
+exit:
+  g_mutex_unlock(&receiver->mutex);
+}
+
+static void
+sockmux_receiver_init (SockMuxReceiver *receiver)
+{
+  guint i;
+
+  receiver->input_cancellable = g_cancellable_new();
+  g_mutex_init(&receiver->mutex);
+  g_mutex_init(&receiver->callbacks_mutex);
+  g_cond_init(&receiver->callbacks_cond);
+  g_mutex_init(&receiver->pool_mutex);
+  g_mutex_init(&receiver->stats_mutex);
+  receiver->id_stats = sockmux_stats_ids_new();
+  receiver->serials = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, g_free);
+  receiver->filtered_callbacks = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                       NULL, (GDestroyNotify) g_slist_free);
+  receiver->handlers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                             NULL, g_free);
+  receiver->streaming_callbacks = g_hash_table_new(g_direct_hash, g_direct_equal);
+  receiver->batch = g_array_new(FALSE, FALSE, sizeof(SockMuxReceiverMessage));
+  receiver->batch_copies = g_array_new(FALSE, FALSE, sizeof(SockMuxReceiverMessage));
+
+  for (i = 0; i < SOCKMUX_FRAME_LANES; i++)
+    receiver->lanes[i].data = g_byte_array_new();
+
+  receiver->windows = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, g_free);
+  g_mutex_init(&receiver->credit_mutex);
+  receiver->inflated = g_byte_array_new();
+
+  receiver->read_buffer_size = DEFAULT_READ_BUFFER_SIZE;
+  receiver->read_buffer_auto = TRUE;
+  receiver->read_size = DEFAULT_READ_BUFFER_SIZE;
+}
+
+gulong sockmux_receiver_connect_range (SockMuxReceiver *receiver,
+                                       guint first_id,
+                                       guint last_id,
+                                       SockMuxReceiverCallbackFunc func,
+                                       gpointer userdata)
+{
+  SockMuxReceiverCallback *cb;
+
+  g_return_val_if_fail(SOCKMUX_IS_RECEIVER(receiver), 0);
+  g_return_val_if_fail(func != NULL, 0);
+  g_return_val_if_fail(first_id <= last_id, 0);
+
+  cb = g_new0(SockMuxReceiverCallback, 1);
+  cb->first_id = first_id;
+  cb->last_id = last_id;
+  cb->func = func;
+  cb->userdata = userdata;
+
+  g_mutex_lock(&receiver->callbacks_mutex);
+  cb->handler_id = ++receiver->last_handler_id;
+  g_hash_table_insert(receiver->handlers,
+                      GSIZE_TO_POINTER(cb->handler_id), cb);
+
+  if (first_id == last_id)
+    {
+      gpointer key = GUINT_TO_POINTER(first_id);
+      GSList *list = g_hash_table_lookup(receiver->filtered_callbacks, key);
+
+      if (list)
+        list = g_slist_append(list, cb);
+      else
+        g_hash_table_insert(receiver->filtered_callbacks, key,
+                            g_slist_append(NULL, cb));
+    }
+  else
+    receiver->callbacks = g_slist_append(receiver->callbacks, cb);
+  g_mutex_unlock(&receiver->callbacks_mutex);
+
+  return cb->handler_id;
+}
+
+gulong sockmux_receiver_connect (SockMuxReceiver *receiver,
+                                 SockMuxReceiverCallbackFunc func,
+                                 gpointer userdata)
+{
+  return sockmux_receiver_connect_range(receiver, 0, G_MAXUINT,
+                                        func, userdata);
+}
+
+gulong sockmux_receiver_connect_filtered (SockMuxReceiver *receiver,
+                                          guint message_id,
+                                          SockMuxReceiverCallbackFunc func,
+                                          gpointer userdata)
+{
+  return sockmux_receiver_connect_range(receiver, message_id, message_id,
+                                        func, userdata);
+}
+
+gulong sockmux_receiver_connect_streaming (SockMuxReceiver *receiver,
+                                           guint message_id,
+                                           SockMuxReceiverStreamBeginFunc begin,
+                                           SockMuxReceiverStreamChunkFunc chunk,
+                                           SockMuxReceiverStreamEndFunc end,
+                                           gpointer userdata)
+{
+  SockMuxReceiverCallback *cb;
+  gpointer key = GUINT_TO_POINTER(message_id);
+
+  g_return_val_if_fail(SOCKMUX_IS_RECEIVER(receiver), 0);
+  g_return_val_if_fail(chunk != NULL, 0);
+
+  cb = g_new0(SockMuxReceiverCallback, 1);
+  cb->first_id = message_id;
+  cb->last_id = message_id;
+  cb->streaming = TRUE;
+  cb->begin = begin;
+  cb->chunk = chunk;
+  cb->end = end;
+  cb->userdata = userdata;
+
+  g_mutex_lock(&receiver->callbacks_mutex);
+  if (g_hash_table_lookup(receiver->streaming_callbacks, key))
+    {
+      g_mutex_unlock(&receiver->callbacks_mutex);
+      g_free(cb);
+      g_warning("%s(): message id 0x%x is already streamed", __func__, message_id);
+      return 0;
+    }
+
+  cb->handler_id = ++receiver->last_handler_id;
+  g_hash_table_insert(receiver->handlers,
+                      GSIZE_TO_POINTER(cb->handler_id), cb);
+  g_hash_table_insert(receiver->streaming_callbacks, key, cb);
+  g_mutex_unlock(&receiver->callbacks_mutex);
+
+  return cb->handler_id;
+}
+
+gulong sockmux_receiver_connect_batch (SockMuxReceiver *receiver,
+                                       SockMuxReceiverBatchFunc func,
+                                       gpointer userdata)
+{
+  SockMuxReceiverCallback *cb;
+
+  g_return_val_if_fail(SOCKMUX_IS_RECEIVER(receiver), 0);
+  g_return_val_if_fail(func != NULL, 0);
+
+  cb = g_new0(SockMuxReceiverCallback, 1);
+  cb->batched = TRUE;
+  cb->batch = func;
+  cb->userdata = userdata;
+
+  g_mutex_lock(&receiver->callbacks_mutex);
+  cb->handler_id = ++receiver->last_handler_id;
+  g_hash_table_insert(receiver->handlers,
+                      GSIZE_TO_POINTER(cb->handler_id), cb);
+  receiver->batch_callbacks = g_slist_append(receiver->batch_callbacks, cb);
+  g_atomic_int_inc(&receiver->n_batch_callbacks);
+  g_mutex_unlock(&receiver->callbacks_mutex);
+
+  return cb->handler_id;
+}
+
+void sockmux_receiver_disconnect (SockMuxReceiver *receiver,
+                                  gulong handler_id)
+{
+  SockMuxReceiverCallback *cb;
+  gpointer key = GSIZE_TO_POINTER(handler_id);
+  guint i;
+
+  g_return_if_fail(SOCKMUX_IS_RECEIVER(receiver));
+
+  g_mutex_lock(&receiver->callbacks_mutex);
+
+  cb = g_hash_table_lookup(receiver->handlers, key);
+  if (cb == NULL)
+    {
+      g_mutex_unlock(&receiver->callbacks_mutex);
+      g_warning("%s(): no handler with id %lu", __func__, handler_id);
+      return;
+    }
+
+  g_hash_table_steal(receiver->handlers, key);
+  sockmux_receiver_remove_callback(receiver, cb);
+  g_atomic_int_set(&cb->disconnected, TRUE);
+
+  /* the rest of a message being streamed is dropped */
+  if (receiver->stream_cb == cb)
+    receiver->stream_cb = NULL;
+
+  for (i = 0; i < SOCKMUX_FRAME_LANES; i++)
+    if (receiver->lanes[i].stream_cb == cb)
+      receiver->lanes[i].stream_cb = NULL;
+
+  /*
+   * Wait for calls in other threads to return. From within a callback,
+   * that could wait for the caller itself, so the last call frees it.
+   */
+  if (cb->running > 0 && sockmux_receiver_in_callback(receiver))
+    cb->orphaned = TRUE;
+  else
+    {
+      while (cb->running > 0)
+        g_cond_wait(&receiver->callbacks_cond, &receiver->callbacks_mutex);
+
+      g_free(cb);
+    }
+
+  g_mutex_unlock(&receiver->callbacks_mutex);
+}
+
+void sockmux_receiver_set_sender (SockMuxReceiver *receiver,
+                                  SockMuxSender *sender)
+{
+  GHashTableIter iter;
+  gpointer key;
+  SockMuxWindow *window;
+  SockMuxSender *old;
+  GArray *windows;
+  gboolean handshake_received;
+  guint i;
+
+  g_return_if_fail(SOCKMUX_IS_RECEIVER(receiver));
+  g_return_if_fail(sender == NULL || SOCKMUX_IS_SENDER(sender));
+
+  if (sender)
+    g_object_ref(sender);
+
+  /* pairs of message ID and window size */
+  windows = g_array_new(FALSE, FALSE, sizeof(guint));
+
+  g_mutex_lock(&receiver->credit_mutex);
+  old = receiver->sender;
+  receiver->sender = sender;
+  handshake_received = receiver->handshake_received;
+
+  /* advertise the windows that were set up before */
+  receiver->unreturned = 0;
+  g_hash_table_iter_init(&iter, receiver->windows);
+  while (g_hash_table_iter_next(&iter, &key, (gpointer *) &window))
+    {
+      guint pair[2] = { GPOINTER_TO_UINT(key), window->window };
+
+      window->consumed = 0;
+      g_array_append_vals(windows, pair, 2);
+    }
+
+  if (sender)
+    g_object_ref(sender);
+  g_mutex_unlock(&receiver->credit_mutex);
+
+  if (old)
+    g_object_unref(old);
+
+  if (sender)
+    {
+      if (handshake_received)
+        sockmux_sender_set_peer_capabilities(sender, receiver->peer_capabilities);
+
+      for (i = 0; i < windows->len; i += 2)
+        sockmux_sender_send_credit(sender, g_array_index(windows, guint, i),
+                                   g_array_index(windows, guint, i + 1));
+
+      g_object_unref(sender);
+    }
+
+  g_array_free(windows, TRUE);
+}
+
+void sockmux_receiver_set_window (SockMuxReceiver *receiver,
+                                  guint message_id,
+                                  guint window_size,
+                                  gboolean manual)
+{
+  SockMuxWindow *window;
+  SockMuxSender *sender = NULL;
+  gpointer key = GUINT_TO_POINTER(message_id);
+  guint credit = 0;
+
+  g_return_if_fail(SOCKMUX_IS_RECEIVER(receiver));
+  g_return_if_fail(window_size > 0);
+
+  g_mutex_lock(&receiver->credit_mutex);
+
+  window = g_hash_table_lookup(receiver->windows, key);
+  if (window == NULL)
+    {
+      window = g_new0(SockMuxWindow, 1);
+      g_hash_table_insert(receiver->windows, key, window);
+    }
+
+  if (window_size < window->window)
+    {
+      g_mutex_unlock(&receiver->credit_mutex);
+      g_warning("%s(): the window of message id 0x%x can't shrink", __func__, message_id);
+      return;
+    }
+
+  if (receiver->sender && window_size > window->window)
+    {
+      credit = window_size - window->window;
+      sender = sockmux_receiver_ref_sender_locked(receiver);
+    }
+
+  window->window = window_size;
+  window->manual = manual;
+
+  g_mutex_unlock(&receiver->credit_mutex);
+
+  sockmux_receiver_send_credit(sender, message_id, credit);
+}
+
+void sockmux_receiver_consume (SockMuxReceiver *receiver,
+                               guint message_id,
+                               guint size)
+{
+  SockMuxWindow *window;
+  SockMuxSender *sender;
+  gsize uncredited;
+  guint credit;
+
+  g_return_if_fail(SOCKMUX_IS_RECEIVER(receiver));
+
+  g_mutex_lock(&receiver->credit_mutex);
+
+  window = g_hash_table_lookup(receiver->windows, GUINT_TO_POINTER(message_id));
+  if (window == NULL)
+    {
+      g_mutex_unlock(&receiver->credit_mutex);
+      return;
+    }
+
+  /* the peer did not charge for those */
+  uncredited = MIN(window->uncredited, size);
+  window->uncredited -= uncredited;
+
+  sockmux_receiver_add_consumed_locked(receiver, window, size - uncredited);
+  credit = sockmux_receiver_take_window_locked(receiver, window);
+  sender = sockmux_receiver_ref_sender_locked(receiver);
+
+  g_mutex_unlock(&receiver->credit_mutex);
+
+  sockmux_receiver_send_credit(sender, message_id, credit);
+}
+
+guint64 sockmux_receiver_get_skipped_bytes (SockMuxReceiver *receiver)
+{
+  guint64 skipped;
+
+  g_return_val_if_fail(SOCKMUX_IS_RECEIVER(receiver), 0);
+
+  g_mutex_lock(&receiver->stats_mutex);
+  skipped = receiver->stats.skipped_bytes;
+  g_mutex_unlock(&receiver->stats_mutex);
+
+  return skipped;
+}
+
+void sockmux_receiver_feed (SockMuxReceiver *receiver,
+                            const guint8 *data,
+                            gsize size)
+{
+  g_return_if_fail(SOCKMUX_IS_RECEIVER(receiver));
+  g_return_if_fail(receiver->input == NULL);
+
+  if (size == 0)
+    return;
+
+  g_mutex_lock(&receiver->mutex);
+
+  if (!receiver->closing)
+    {
+      sockmux_receiver_count_read(receiver, size);
+      sockmux_buffer_append(&receiver->input_buf, data, size);
+      dispatch_input(receiver);
+    }
+
+  g_mutex_unlock(&receiver->mutex);
+}
+
+static gboolean
+sockmux_receiver_wait_readable (gint           fd,
+                                gint64         deadline,
+                                GCancellable  *cancellable,
+                                GError       **error)
+{
+  GPollFD fds[2];
+  gint n = 1, ret;
+
+  fds[0].fd = fd;
+  fds[0].events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+  fds[0].revents = 0;
+
+  if (g_cancellable_make_pollfd(cancellable, &fds[1]))
+    n++;
+
+  do
+    ret = g_poll(fds, n, MAX((deadline - g_get_monotonic_time() + 999) / 1000, 0));
+  while (ret < 0 && errno == EINTR);
+
+  if (n > 1)
+    g_cancellable_release_fd(cancellable);
+
+  if (g_cancellable_set_error_if_cancelled(cancellable, error))
+    return FALSE;
+
+  if (ret < 0)
+    {
+      g_set_error_literal(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                          g_strerror(errno));
+      return FALSE;
+    }
+
+  if (ret == 0)
+    {
+      g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                          "Timed out waiting for a message");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+gboolean sockmux_receiver_read_message (SockMuxReceiver *receiver,
+                                        guint *message_id,
+                                        GBytes **payload,
+                                        gint timeout,
+                                        GCancellable *cancellable,
+                                        GError **error)
+{
+  SockMuxPending *pending;
+  gint64 deadline = 0;
+  guint64 errors;
+  gssize len;
+  gsize size;
+  gint fd = -1;
+
+  g_return_val_if_fail(SOCKMUX_IS_RECEIVER(receiver), FALSE);
+  g_return_val_if_fail(receiver->blocking, FALSE);
+
+  if (timeout >= 0)
+    {
+      if (!G_IS_FILE_DESCRIPTOR_BASED(receiver->input))
+        {
+          g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                              "Timeouts need a stream with a file descriptor");
+          return FALSE;
+        }
+
+      fd = g_file_descriptor_based_get_fd(G_FILE_DESCRIPTOR_BASED(receiver->input));
+      deadline = g_get_monotonic_time() + timeout * G_TIME_SPAN_MILLISECOND;
+    }
+
+  g_mutex_lock(&receiver->mutex);
+  size = sockmux_receiver_read_size(receiver);
+
+  while (g_queue_is_empty(&receiver->pending))
+    {
+      if (fd >= 0 && !sockmux_receiver_wait_readable(fd, deadline, cancellable, error))
+        goto error;
+
+      len = g_input_stream_read(receiver->input,
+                                sockmux_buffer_reserve(&receiver->input_buf, size),
+                                size, cancellable, error);
+      if (len < 0)
+        goto error;
+
+      if (len == 0)
+        {
+          g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+                              "The stream ended");
+          goto error;
+        }
+
+      sockmux_receiver_count_read(receiver, len);
+      receiver->input_buf.end += len;
+
+      g_mutex_lock(&receiver->stats_mutex);
+      errors = receiver->stats.protocol_errors;
+      g_mutex_unlock(&receiver->stats_mutex);
+
+      dispatch_input(receiver);
+
+      /* without resync, the input can't be parsed beyond this point */
+      g_mutex_lock(&receiver->stats_mutex);
+      errors = receiver->stats.protocol_errors - errors;
+      g_mutex_unlock(&receiver->stats_mutex);
+
+      if (errors > 0 && !receiver->resync)
+        {
+          g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                              "The input is corrupted");
+          goto error;
+        }
+
+      size = sockmux_receiver_next_read_size(receiver, len);
+    }
+
+  pending = g_queue_pop_head(&receiver->pending);
+  sockmux_receiver_return_credit(receiver, pending->message_id,
+                                 g_bytes_get_size(pending->payload),
+                                 TRUE, pending->credited);
+  if (g_queue_is_empty(&receiver->pending))
+    sockmux_receiver_flush_credit(receiver);
+  g_mutex_unlock(&receiver->mutex);
+
+  if (message_id)
+    *message_id = pending->message_id;
+
+  if (payload)
+    *payload = pending->payload;
+  else
+    g_bytes_unref(pending->payload);
+
+  g_free(pending);
+
+  return TRUE;
+
+error:
+  g_mutex_unlock(&receiver->mutex);
+
+  return FALSE;
+}
+
+void sockmux_receiver_get_stats (SockMuxReceiver *receiver,
+                                 SockMuxReceiverStats *stats)
+{
+  g_return_if_fail(SOCKMUX_IS_RECEIVER(receiver));
+  g_return_if_fail(stats != NULL);
+
+  g_mutex_lock(&receiver->stats_mutex);
+  *stats = receiver->stats;
+  g_mutex_unlock(&receiver->stats_mutex);
+}
+
+GVariant *sockmux_receiver_get_stats_variant (SockMuxReceiver *receiver)
+{
+  SockMuxReceiverStats stats;
+  GVariantBuilder builder;
+  GVariant *ids, *other;
+
+  g_return_val_if_fail(SOCKMUX_IS_RECEIVER(receiver), NULL);
+
+  g_mutex_lock(&receiver->stats_mutex);
+  stats = receiver->stats;
+  ids = sockmux_stats_ids_variant(receiver->id_stats);
+  other = sockmux_stats_other_variant(receiver->id_stats);
+  g_mutex_unlock(&receiver->stats_mutex);
+
+  g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add(&builder, "{sv}", "messages-received",
+                        g_variant_new_uint64(stats.messages_received));
+  g_variant_builder_add(&builder, "{sv}", "bytes-received",
+                        g_variant_new_uint64(stats.bytes_received));
+  g_variant_builder_add(&builder, "{sv}", "bytes-read",
+                        g_variant_new_uint64(stats.bytes_read));
+  g_variant_builder_add(&builder, "{sv}", "read-calls",
+                        g_variant_new_uint64(stats.read_calls));
+  g_variant_builder_add(&builder, "{sv}", "messages-dropped",
+                        g_variant_new_uint64(stats.messages_dropped));
+  g_variant_builder_add(&builder, "{sv}", "protocol-errors",
+                        g_variant_new_uint64(stats.protocol_errors));
+  g_variant_builder_add(&builder, "{sv}", "skipped-bytes",
+                        g_variant_new_uint64(stats.skipped_bytes));
+  g_variant_builder_add(&builder, "{sv}", "callback-time",
+                        g_variant_new_uint64(stats.callback_time));
+  g_variant_builder_add(&builder, "{sv}", "size-histogram",
+                        sockmux_stats_histogram_variant(stats.size_histogram));
+  g_variant_builder_add(&builder, "{sv}", "callback-histogram",
+                        sockmux_stats_histogram_variant(stats.callback_histogram));
+  g_variant_builder_add(&builder, "{sv}", "message-ids", ids);
+  g_variant_builder_add(&builder, "{sv}", "other-message-ids", other);
+
+  return g_variant_builder_end(&builder);
+}
+
+void sockmux_receiver_set_max_message_size (SockMuxReceiver *receiver,
+                                            guint max_message_size)
+{
+  g_return_if_fail(SOCKMUX_IS_RECEIVER(receiver));
+  receiver->max_message_size = max_message_size;
+}
+
+static gboolean
+sockmux_receiver_start (gpointer data)
+{
+  SockMuxReceiver *receiver = SOCKMUX_RECEIVER(data);
+
+  sockmux_receiver_read(receiver, receiver->read_size);
+
+  return FALSE;
+}
+
+SockMuxReceiver *sockmux_receiver_new_full (GInputStream *stream,
+                                            guint magic,
+                                            GMainContext *context)
+{
+  SockMuxReceiver *receiver = g_object_new(SOCKMUX_TYPE_RECEIVER, NULL);
+
+  receiver->input = stream;
+  receiver->magic = magic;
+
+  /* the input comes from sockmux_receiver_feed() then */
+  if (stream == NULL)
+    return receiver;
+
+  /*
+   * Kick off initial read. Reads complete in the context they were
+   * started from, and each one starts the next.
+   */
+  if (context == NULL)
+    sockmux_receiver_read(receiver, receiver->read_size);
+  else
+    g_main_context_invoke_full(context, G_PRIORITY_DEFAULT,
+                               sockmux_receiver_start,
+                               g_object_ref(receiver), g_object_unref);
+
+  return receiver;
+}
+
+SockMuxReceiver *sockmux_receiver_new (GInputStream *stream,
+                                       guint magic)
+{
+  return sockmux_receiver_new_full(stream, magic, NULL);
+}
+
+SockMuxReceiver *sockmux_receiver_new_blocking (GInputStream *stream,
+                                                guint magic)
+{
+  SockMuxReceiver *receiver;
+
+  g_return_val_if_fail(G_IS_INPUT_STREAM(stream), NULL);
+
+  /* no reads are started, they are done by sockmux_receiver_read_message() */
+  receiver = sockmux_receiver_new_full(NULL, magic, NULL);
+  receiver->input = stream;
+  receiver->blocking = TRUE;
+
+  return receiver;
+}
+
+static void
+sockmux_pending_free (SockMuxPending *pending)
+{
+  g_bytes_unref(pending->payload);
+  g_free(pending);
+}
+
+static void
+sockmux_receiver_finalize (GObject *object)
+{
+  SockMuxReceiver *receiver = SOCKMUX_RECEIVER(object);
+  guint i;
+
+  g_mutex_lock(&receiver->mutex);
+  receiver->closing = TRUE;
+  g_cancellable_cancel(receiver->input_cancellable);
+  g_mutex_unlock(&receiver->mutex);
+
+  g_object_unref(receiver->input_cancellable);
+  receiver->input_cancellable = NULL;
+
+  g_free(receiver->input_buf.data);
+  receiver->input_buf.data = NULL;
+
+  g_queue_clear_full(&receiver->pending, (GDestroyNotify) sockmux_pending_free);
+
+  g_slist_free(receiver->callbacks);
+  g_slist_free(receiver->batch_callbacks);
+  g_array_free(receiver->batch, TRUE);
+  g_array_free(receiver->batch_copies, TRUE);
+  g_hash_table_destroy(receiver->filtered_callbacks);
+  g_hash_table_destroy(receiver->streaming_callbacks);
+  g_hash_table_destroy(receiver->handlers);
+
+  /* every scheduled ID holds a reference, so the pool is idle by now */
+  if (receiver->pool)
+    g_thread_pool_free(receiver->pool, FALSE, FALSE);
+  g_hash_table_destroy(receiver->serials);
+  g_mutex_clear(&receiver->pool_mutex);
+  sockmux_stats_ids_free(receiver->id_stats);
+  g_mutex_clear(&receiver->stats_mutex);
+  g_mutex_clear(&receiver->callbacks_mutex);
+  g_cond_clear(&receiver->callbacks_cond);
+
+  for (i = 0; i < SOCKMUX_FRAME_LANES; i++)
+    g_byte_array_unref(receiver->lanes[i].data);
+
+  g_hash_table_destroy(receiver->windows);
+  g_mutex_clear(&receiver->credit_mutex);
+  g_byte_array_unref(receiver->inflated);
+  if (receiver->decompressor)
+    g_object_unref(receiver->decompressor);
+  if (receiver->sender)
+    g_object_unref(receiver->sender);
+  
+  g_mutex_clear(&receiver->mutex);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+sockmux_receiver_class_init (SockMuxReceiverClass *klass)
+{
+  GObjectClass *object_class;
+  GParamSpec *pspec;
+
+  parent_class = (GObjectClass *) g_type_class_peek_parent (klass);
+  object_class = (GObjectClass *) klass;
+
+  object_class->get_property = sockmux_receiver_get_property;
   object_class->set_property = sockmux_receiver_set_property;
   object_class->finalize = sockmux_receiver_finalize;
 
@@ -390,6 +2539,48 @@ sockmux_receiver_class_init (SockMuxReceiverClass *klass)
                            G_PARAM_READWRITE);
   g_object_class_install_property (object_class, PROP_MAX_MESSAGE_SIZE, pspec);
 
+  pspec = g_param_spec_int(SOCKMUX_RECEIVER_PROP_READ_BUFFER_SIZE,
+                           "The size of a single read from the input stream",
+                           "Get the number",
+                           1, G_MAXINT, DEFAULT_READ_BUFFER_SIZE,
+                           G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_READ_BUFFER_SIZE, pspec);
+
+  pspec = g_param_spec_boolean(SOCKMUX_RECEIVER_PROP_READ_BUFFER_AUTO,
+                               "Grow reads beyond read-buffer-size during bulk transfers",
+                               "Get the value",
+                               TRUE,
+                               G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_READ_BUFFER_AUTO, pspec);
+
+  pspec = g_param_spec_boolean(SOCKMUX_RECEIVER_PROP_RESYNC,
+                               "Skip corrupted input up to the next valid header",
+                               "Get the value",
+                               FALSE,
+                               G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_RESYNC, pspec);
+
+  pspec = g_param_spec_int(SOCKMUX_RECEIVER_PROP_DISPATCH_THREADS,
+                           "The number of threads to run message callbacks in, 0 to run them while reading",
+                           "Get the number",
+                           0, G_MAXINT, 0,
+                           G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_DISPATCH_THREADS, pspec);
+
+  pspec = g_param_spec_uint64(SOCKMUX_RECEIVER_PROP_MESSAGES_RECEIVED,
+                              "The number of messages passed on or streamed",
+                              "Get the number",
+                              0, G_MAXUINT64, 0,
+                              G_PARAM_READABLE);
+  g_object_class_install_property (object_class, PROP_MESSAGES_RECEIVED, pspec);
+
+  pspec = g_param_spec_uint64(SOCKMUX_RECEIVER_PROP_BYTES_READ,
+                              "The number of bytes read from the stream",
+                              "Get the number",
+                              0, G_MAXUINT64, 0,
+                              G_PARAM_READABLE);
+  g_object_class_install_property (object_class, PROP_BYTES_READ, pspec);
+
   signals[SIGNAL_STREAM_END] =
     g_signal_new ("stream-end",
                   G_OBJECT_CLASS_TYPE (klass),
@@ -24,9 +24,17 @@
 
 #include <glib-object.h>
 
+#include "sender.h"
+
 G_BEGIN_DECLS
 
 #define SOCKMUX_RECEIVER_PROP_MAX_MESSAGE_SIZE "max-message-size"
+#define SOCKMUX_RECEIVER_PROP_READ_BUFFER_SIZE "read-buffer-size"
+#define SOCKMUX_RECEIVER_PROP_READ_BUFFER_AUTO "read-buffer-auto"
+#define SOCKMUX_RECEIVER_PROP_RESYNC           "resync"
+#define SOCKMUX_RECEIVER_PROP_DISPATCH_THREADS "dispatch-threads"
+#define SOCKMUX_RECEIVER_PROP_MESSAGES_RECEIVED "messages-received"
+#define SOCKMUX_RECEIVER_PROP_BYTES_READ        "bytes-read"
 
 typedef struct _SockMuxReceiver      SockMuxReceiver;
 typedef struct _SockMuxReceiverClass SockMuxReceiverClass;
@@ -46,21 +54,201 @@ typedef void (* SockMuxReceiverCallbackFunc) (SockMuxReceiver *receiver,
                                               guint size,
                                               gpointer userdata);
 
+/* a message as passed to batch callbacks */
+typedef struct {
+  guint         message_id;
+  const guint8 *data;
+  guint         size;
+} SockMuxReceiverMessage;
+
+typedef void (* SockMuxReceiverBatchFunc) (SockMuxReceiver *receiver,
+                                           const SockMuxReceiverMessage *messages,
+                                           guint n_messages,
+                                           gpointer userdata);
+
+typedef void (* SockMuxReceiverStreamBeginFunc) (SockMuxReceiver *receiver,
+                                                 guint message_id,
+                                                 guint size,
+                                                 gpointer userdata);
+
+typedef void (* SockMuxReceiverStreamChunkFunc) (SockMuxReceiver *receiver,
+                                                 guint message_id,
+                                                 const guint8 *data,
+                                                 guint size,
+                                                 gpointer userdata);
+
+typedef void (* SockMuxReceiverStreamEndFunc) (SockMuxReceiver *receiver,
+                                               guint message_id,
+                                               gpointer userdata);
+
 void sockmux_receiver_set_max_message_size (SockMuxReceiver *receiver,
                                             guint max_message_size);
 
-void sockmux_receiver_connect (SockMuxReceiver *receiver,
-                               SockMuxReceiverCallbackFunc func,
-                               gpointer userdata);
+/*
+ * Number of bytes of corrupted input that were skipped since the
+ * receiver was created, if the "resync" property is set.
+ */
+guint64 sockmux_receiver_get_skipped_bytes (SockMuxReceiver *receiver);
+
+/* histograms have SOCKMUX_STATS_BUCKETS buckets, as for the sender */
+typedef struct {
+  guint64 messages_received;  /* including streamed ones */
+  guint64 bytes_received;     /* payload, after decompression */
+  guint64 bytes_read;         /* everything read from the stream */
+  guint64 read_calls;
+  guint64 messages_dropped;   /* larger than max-message-size */
+  guint64 protocol_errors;
+  guint64 skipped_bytes;
+  guint64 callback_time;      /* usecs spent in message callbacks */
+  guint64 size_histogram[SOCKMUX_STATS_BUCKETS];      /* payload bytes */
+  guint64 callback_histogram[SOCKMUX_STATS_BUCKETS];  /* usecs per message */
+} SockMuxReceiverStats;
+
+/*
+ * Fills @stats with a snapshot of the counters since the receiver was
+ * created. The variant version returns the same as a floating a{sv},
+ * plus "message-ids", which maps each message ID to the number of
+ * messages and payload bytes received with it (a{u(tt)}). Only the first
+ * SOCKMUX_STATS_MAX_IDS IDs seen get an entry, "other-message-ids" ((tt))
+ * sums up the messages with any other ID.
+ */
+void      sockmux_receiver_get_stats         (SockMuxReceiver      *receiver,
+                                              SockMuxReceiverStats *stats);
+GVariant *sockmux_receiver_get_stats_variant (SockMuxReceiver      *receiver);
+
+/*
+ * The connect functions return a handler ID for
+ * sockmux_receiver_disconnect(), which may also be called from within
+ * a callback. Once it returns, the callback is not called any more,
+ * and calls in progress in other threads have returned, so its
+ * userdata can be freed. Called from within a callback of the same
+ * receiver, it can't wait for those, and the callback may still run in
+ * other threads for a moment. It must not be called while holding a
+ * lock that the callback takes.
+ *
+ * If "dispatch-threads" is set, message callbacks are called from a
+ * pool of that many threads while reading goes on. Messages with the
+ * same ID are still passed on one at a time and in order; different
+ * IDs are handled in parallel. Each message is copied for this, and
+ * unless flow control is used, nothing limits how many of them queue
+ * up. Streaming callbacks are not affected. Once set, the number of
+ * threads can be changed, but not back to 0.
+ */
+gulong sockmux_receiver_connect (SockMuxReceiver *receiver,
+                                 SockMuxReceiverCallbackFunc func,
+                                 gpointer userdata);
+
+gulong sockmux_receiver_connect_filtered (SockMuxReceiver *receiver,
+                                          guint message_id,
+                                          SockMuxReceiverCallbackFunc func,
+                                          gpointer userdata);
 
-void sockmux_receiver_connect_filtered (SockMuxReceiver *receiver,
-                                        guint message_id,
-                                        SockMuxReceiverCallbackFunc func,
-                                        gpointer userdata);
+/* called for all messages with first_id <= message_id <= last_id */
+gulong sockmux_receiver_connect_range (SockMuxReceiver *receiver,
+                                       guint first_id,
+                                       guint last_id,
+                                       SockMuxReceiverCallbackFunc func,
+                                       gpointer userdata);
+
+/*
+ * Messages with @message_id are not buffered but handed to @chunk piece
+ * by piece as they arrive, framed by calls to @begin and @end. They are
+ * not subject to max-message-size and are not passed to any other
+ * callback. Only one streaming callback can be connected per message ID.
+ */
+gulong sockmux_receiver_connect_streaming (SockMuxReceiver *receiver,
+                                           guint message_id,
+                                           SockMuxReceiverStreamBeginFunc begin,
+                                           SockMuxReceiverStreamChunkFunc chunk,
+                                           SockMuxReceiverStreamEndFunc end,
+                                           gpointer userdata);
+
+/*
+ * @func is called once per read with all messages that were complete
+ * after it, in order, in addition to the message callbacks. The data
+ * is only valid during the call. Batch callbacks are always called
+ * from the reading thread, and not for streamed messages or by
+ * blocking receivers.
+ */
+gulong sockmux_receiver_connect_batch (SockMuxReceiver *receiver,
+                                       SockMuxReceiverBatchFunc func,
+                                       gpointer userdata);
+
+void sockmux_receiver_disconnect (SockMuxReceiver *receiver,
+                                  gulong handler_id);
+
+/*
+ * Links the receiver with the sender that talks to the same peer.
+ * Credit for flow controlled message IDs is sent to the peer through
+ * it, and credit received from the peer is passed on to it.
+ */
+void sockmux_receiver_set_sender (SockMuxReceiver *receiver,
+                                  SockMuxSender *sender);
+
+/*
+ * Limits the payload of @message_id that the peer may have in flight
+ * to @window_size bytes. Credit is returned once a message has been
+ * passed to the callbacks, or, if @manual is set, when the application
+ * calls sockmux_receiver_consume(). It is sent in batches of half a
+ * window, and the rest at the end of each read. Messages the peer sent
+ * before it got the window are not charged and give no credit back, so
+ * consuming them has no effect. Windows can only grow.
+ */
+void sockmux_receiver_set_window (SockMuxReceiver *receiver,
+                                  guint message_id,
+                                  guint window_size,
+                                  gboolean manual);
+
+/* may be called from any thread, including from within callbacks */
+void sockmux_receiver_consume (SockMuxReceiver *receiver,
+                               guint message_id,
+                               guint size);
 
 SockMuxReceiver *sockmux_receiver_new(GInputStream *stream,
                                       guint magic);
 
+/*
+ * Reads from @stream in @context, which must be run by some thread,
+ * such as the one of sockmux_sender_get_context(). Callbacks and
+ * signals are invoked from that thread.
+ */
+SockMuxReceiver *sockmux_receiver_new_full(GInputStream *stream,
+                                           guint magic,
+                                           GMainContext *context);
+
+/*
+ * For receivers created with a NULL stream: parses @size bytes of
+ * input that arrived by other means, such as a datagram or another
+ * library's buffers. Callbacks are invoked before this returns,
+ * unless "dispatch-threads" is set.
+ */
+void sockmux_receiver_feed (SockMuxReceiver *receiver,
+                            const guint8 *data,
+                            gsize size);
+
+/*
+ * A receiver that only reads when sockmux_receiver_read_message() is
+ * called, on the calling thread and without a main loop. Message
+ * callbacks are not called, streaming callbacks still are.
+ */
+SockMuxReceiver *sockmux_receiver_new_blocking(GInputStream *stream,
+                                               guint magic);
+
+/*
+ * Blocks until the next message has been read, and returns its ID and
+ * payload. With a @timeout in milliseconds of 0 or more, which needs a
+ * stream with a file descriptor, G_IO_ERROR_TIMED_OUT is returned if
+ * nothing arrives in time. At the end of the stream, the error is
+ * G_IO_ERROR_CONNECTION_CLOSED; on corrupted input without "resync",
+ * G_IO_ERROR_INVALID_DATA.
+ */
+gboolean sockmux_receiver_read_message (SockMuxReceiver *receiver,
+                                        guint *message_id,
+                                        GBytes **payload,
+                                        gint timeout,
+                                        GCancellable *cancellable,
+                                        GError **error);
+
 GType sockmux_receiver_get_type (void);
 #define SOCKMUX_TYPE_RECEIVER             sockmux_receiver_get_type()
 #define SOCKMUX_RECEIVER(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj), SOCKMUX_TYPE_RECEIVER, SockMuxReceiver))
@@ -19,40 +19,192 @@
  * MA 02110-1301 USA.
  */
 
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
 #include <glib.h>
 #include <gio/gio.h>
+#include <gio/gfiledescriptorbased.h>
 
 #include "protocol.h"
+#include "pool-private.h"
 #include "sender.h"
+#include "stats.h"
+#include "trace.h"
 
 #define PROTOCOL_VERSION 1
+#define MAX_PROTOCOL_VERSION 2
 #define DEFAULT_MAX_CHUNK_SIZE (16 * 1024)
+#define MAX_OUTPUT_VECTORS 64
+#define DEFAULT_COMPRESSION_THRESHOLD 512
+
+typedef struct _SockMuxAsync SockMuxAsync;
+typedef struct _SockMuxBody SockMuxBody;
+typedef struct _SockMuxChannel SockMuxChannel;
 
 struct _SockMuxSender {
   GObject  parent;
 
   GOutputStream *output;
+  gint           output_fd;
+  gboolean       fast_path;
   GCancellable  *output_cancellable;
-  GSList        *output_queue;
+  gboolean       busy;
+  guint          protocol_version;
+
+  /* one queue per priority, and the entries of the write in flight */
+  GQueue         lanes[SOCKMUX_SENDER_N_PRIORITIES];
+  guint          output_queue_length;
+  gsize          output_queue_size;
+  SockMuxAsync  *current;
+  SockMuxAsync  *batch[MAX_OUTPUT_VECTORS];
+  gsize          batch_size[MAX_OUTPUT_VECTORS];
+  guint          n_batch;
+
+  /* flow controlled channels, and the messages waiting for credit */
+  GHashTable    *channels;
+  guint          blocked_length;
+  gsize          blocked_size;
+
   guint          max_output_queue;
+
+  /* backpressure: "queue-full" above the high mark, "writable" at the low one */
+  guint          high_watermark;
+  guint          low_watermark;
+  gboolean       full;
+
   guint          magic;
-  GMutex        *mutex;
+  GMutex         mutex;
   guint          max_chunk_size;
+  GOutputVector  output_vectors[MAX_OUTPUT_VECTORS];
+
+  /* batching */
+  guint          corked;
+  guint          max_delay;
+  GSource       *delay_source;
+  gboolean       delay_expired;
+
+  SockMuxSenderFlushPolicy flush_policy;
+  guint          flush_bytes;
+  gsize          unflushed;
+
+  /* payload compression, if the peer's receiver can decode it */
+  SockMuxSenderCompression compression;
+  guint          compression_threshold;
+  guint          peer_capabilities;
+  GConverter    *compressor;
+  GMutex         compress_mutex;
+
+  /* bounce buffer for message bodies read from a source stream */
+  guint8        *body_buffer;
+  gsize          body_buffer_size;
+
+  /* a message body failed after its header was out, the peer is out of sync */
+  gint           broken;
+
+  /*
+   * Threaded mode: all I/O runs in a thread of its own, and new entries
+   * are posted to the inbox without taking the mutex. The inbox is a
+   * stack in reverse order of posting, linked through SockMuxAsync.next.
+   */
+  GMainContext  *context;
+  GMainLoop     *thread_loop;
+  GThread       *thread;
+  GSource       *inbox_source;
+  SockMuxAsync  *inbox;
+  gint           inbox_length;
+  gsize          inbox_size;
+
+  /* blocking mode, one sockmux_sender_send_sync() writes at a time */
+  gboolean       blocking;
+  gboolean       syncing;
+  GCond          sync_cond;
+
+  /* counters for sockmux_sender_get_stats(), under the mutex */
+  SockMuxSenderStats stats;
+  SockMuxIdTable *id_stats;
 };
 
 struct _SockMuxAsync {
-  GByteArray *array;
   SockMuxSender *sender;
-  guint offset;
+  SockMuxAsync  *next;
+
+  /* entries are linked into the lane and channel queues without allocations */
+  GList          link;
+  guint          message_id;
+  guint          lane;
+  gboolean       control;
+
+  /*
+   * The header is kept inline, the payload is a separate segment. For
+   * fragmented messages, the header is rewritten for each frame.
+   */
+  union {
+    SockMuxHandshake  handshake;
+    SockMuxHandshake2 handshake2;
+    SockMuxMessage    message;
+    SockMuxFrame      frame;
+  } header;
+  gsize   header_size;
+  gsize   frame_size;
+  guint8  frame_flags;
+  GBytes *payload;
+  guint8 *buffer;
+  gsize   buffer_size;
+  const guint8 *data;
+  gsize   data_skip;
+  gsize   length;
+  gsize   credit_size;
+  gsize   size;
+  gsize   offset;
+  gint64  queued_at;
+
+  /* completed once the last byte has been written, for sockmux_sender_send_async() */
+  GTask  *task;
+
+  /* alternatively, the body is read from a stream or file descriptor */
+  GInputStream *source;
+  gint          source_fd;
+  goffset       source_offset;
+  gboolean      close_source_fd;
 };
 
-typedef struct _SockMuxAsync SockMuxAsync;
+/*
+ * Credit granted by the receiving peer for a message ID. Messages are
+ * sent while there is credit for all of their payload; the others wait
+ * in order until more credit arrives. outstanding is what was charged
+ * and has not come back yet. Only a message larger than the window
+ * overdraws it, and only once nothing else is outstanding.
+ */
+struct _SockMuxChannel {
+  gint64 credit;
+  gsize  outstanding;
+  GQueue pending;
+};
+
+/* one chunk of a message body that is transferred in a worker thread */
+struct _SockMuxBody {
+  gint     out_fd;
+  gint     in_fd;
+  goffset  offset;
+  gsize    count;
+  guint8  *buffer;
+};
 
 static GObjectClass *parent_class = NULL;
 
 enum {
   SIGNAL_WRITE_ERROR,
   SIGNAL_STREAM_OVERFLOW,
+  SIGNAL_QUEUE_FULL,
+  SIGNAL_WRITABLE,
   SIGNAL_LAST
 };
 
@@ -62,6 +214,15 @@ enum {
   PROP_0,
   PROP_MAX_OUTPUT_QUEUE,
   PROP_MAX_CHUNK_SIZE,
+  PROP_MAX_DELAY,
+  PROP_FLUSH_POLICY,
+  PROP_FLUSH_BYTES,
+  PROP_COMPRESSION,
+  PROP_COMPRESSION_THRESHOLD,
+  PROP_HIGH_WATERMARK,
+  PROP_LOW_WATERMARK,
+  PROP_MESSAGES_SENT,
+  PROP_BYTES_WRITTEN,
 };
 
 static void
@@ -79,11 +240,68 @@ sockmux_sender_get_property (GObject    *object,
         g_value_set_int(value, sender->max_output_queue);
         break;
 
+      case PROP_MAX_CHUNK_SIZE:
+        g_value_set_int(value, sender->max_chunk_size);
+        break;
+
+      case PROP_MAX_DELAY:
+        g_value_set_int(value, sender->max_delay);
+        break;
+
+      case PROP_FLUSH_POLICY:
+        g_value_set_int(value, sender->flush_policy);
+        break;
+
+      case PROP_FLUSH_BYTES:
+        g_value_set_int(value, sender->flush_bytes);
+        break;
+
+      case PROP_COMPRESSION:
+        g_value_set_int(value, sender->compression);
+        break;
+
+      case PROP_COMPRESSION_THRESHOLD:
+        g_value_set_int(value, sender->compression_threshold);
+        break;
+
+      case PROP_HIGH_WATERMARK:
+        g_value_set_int(value, sender->high_watermark);
+        break;
+
+      case PROP_LOW_WATERMARK:
+        g_value_set_int(value, sender->low_watermark);
+        break;
+
+      case PROP_MESSAGES_SENT:
+        g_mutex_lock(&sender->mutex);
+        g_value_set_uint64(value, sender->stats.messages_sent);
+        g_mutex_unlock(&sender->mutex);
+        break;
+
+      case PROP_BYTES_WRITTEN:
+        g_mutex_lock(&sender->mutex);
+        g_value_set_uint64(value, sender->stats.bytes_written);
+        g_mutex_unlock(&sender->mutex);
+        break;
+
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
 }
 
+/*
+ * Keeps "low-watermark" below "high-watermark". Otherwise the queue
+ * would already be drained far enough when "queue-full" is emitted,
+ * and "writable" would follow with the very next check.
+ */
+static void
+sockmux_sender_clamp_watermarks (SockMuxSender *sender)
+{
+  if (sender->high_watermark > 0)
+    sender->low_watermark = MIN(sender->low_watermark,
+                                sender->high_watermark - 1);
+}
+
 static void
 sockmux_sender_set_property (GObject      *object,
                              guint         property_id,
@@ -99,6 +317,44 @@ sockmux_sender_set_property (GObject      *object,
         sender->max_output_queue = g_value_get_int(value);
         break;
 
+      case PROP_MAX_CHUNK_SIZE:
+        sender->max_chunk_size = MAX(g_value_get_int(value), 1);
+        break;
+
+      case PROP_MAX_DELAY:
+        sender->max_delay = g_value_get_int(value);
+        break;
+
+      case PROP_FLUSH_POLICY:
+        sender->flush_policy = g_value_get_int(value);
+        break;
+
+      case PROP_FLUSH_BYTES:
+        sender->flush_bytes = MAX(g_value_get_int(value), 1);
+        break;
+
+      case PROP_COMPRESSION:
+        sender->compression = g_value_get_int(value);
+        break;
+
+      case PROP_COMPRESSION_THRESHOLD:
+        sender->compression_threshold = g_value_get_int(value);
+        break;
+
+      case PROP_HIGH_WATERMARK:
+        g_mutex_lock(&sender->mutex);
+        sender->high_watermark = g_value_get_int(value);
+        sockmux_sender_clamp_watermarks(sender);
+        g_mutex_unlock(&sender->mutex);
+        break;
+
+      case PROP_LOW_WATERMARK:
+        g_mutex_lock(&sender->mutex);
+        sender->low_watermark = g_value_get_int(value);
+        sockmux_sender_clamp_watermarks(sender);
+        g_mutex_unlock(&sender->mutex);
+        break;
+
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -107,21 +363,30 @@ sockmux_sender_set_property (GObject      *object,
 static void
 feed_output_stream (SockMuxSender *sender);
 
+static void
+sockmux_sender_flush_queue (SockMuxSender *sender);
+
 static void
 async_flush_cb (GObject      *source,
                 GAsyncResult *result,
                 gpointer      data)
 {
   GError *error = NULL;
+  SockMuxSender *sender = SOCKMUX_SENDER(data);
 
   if (g_output_stream_is_closing(G_OUTPUT_STREAM(source)) ||
       g_output_stream_is_closed(G_OUTPUT_STREAM(source)))
-    return;
+    goto exit;
 
-  SockMuxSender *sender = SOCKMUX_SENDER(data);
   g_return_if_fail(SOCKMUX_IS_SENDER(sender));
 
   g_output_stream_flush_finish(G_OUTPUT_STREAM(source), result, &error);
+  SOCKMUX_TRACE1(flush_done, sender);
+
+  g_mutex_lock(&sender->mutex);
+  sender->busy = FALSE;
+  g_mutex_unlock(&sender->mutex);
+
   if (error)
     {
       g_critical("%s() %s", __func__, error->message);
@@ -132,268 +397,2393 @@ async_flush_cb (GObject      *source,
     {
       feed_output_stream(sender);
     }
+
+exit:
+  g_object_unref(sender);
 }
 
-static void
-async_write_cb (GObject      *source,
-                GAsyncResult *result,
-                gpointer      data)
+/* must be called with the mutex held */
+static gboolean
+sockmux_sender_should_flush (SockMuxSender *sender,
+                             gsize          written,
+                             guint          n_completed)
 {
-  gsize len;
-  GError *error = NULL;
-  SockMuxAsync *async;
-  SockMuxSender *sender;
-
-  /* FIXME: is there really no clean solution to cancel a pending async operation!? */
-  if (g_output_stream_is_closing(G_OUTPUT_STREAM(source)) ||
-      g_output_stream_is_closed(G_OUTPUT_STREAM(source)))
-    return;
-
-  async = data;
-  sender = async->sender;
-  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+  gboolean drained = sender->output_queue_length == 0;
 
-  len = g_output_stream_write_finish(sender->output, result, &error);
+  sender->unflushed += written;
 
-  if (len <= 0)
+  switch (sender->flush_policy)
     {
-      if (error == NULL)
-        {
-          /* write error? */
-          g_critical("Sender write error (%p)", sender);
-          return;
-        }
+      case SOCKMUX_SENDER_FLUSH_NEVER:
+        return FALSE;
 
-      g_critical("%s() %s", __func__, error->message);
-      g_error_free(error);
-      g_signal_emit(sender, signals[SIGNAL_WRITE_ERROR], 0);
-      return;
-    }
+      case SOCKMUX_SENDER_FLUSH_MESSAGE:
+        return n_completed > 0;
 
-  if (async->offset + len == async->array->len)
-    {
-      g_mutex_lock(sender->mutex);
-      sender->output_queue = g_slist_remove(sender->output_queue, async);
-      g_mutex_unlock(sender->mutex);
+      case SOCKMUX_SENDER_FLUSH_DRAIN:
+        return drained;
 
-      g_byte_array_free(async->array, TRUE);
-      g_object_unref(async->sender);
-      g_free(async);
-    }
-  else
-    {
-      async->offset += len;
-    }
+      case SOCKMUX_SENDER_FLUSH_BYTES:
+        return drained || sender->unflushed >= sender->flush_bytes;
 
-  g_output_stream_flush_async(sender->output,
-                              G_PRIORITY_DEFAULT,
-                              NULL,
-                              async_flush_cb, sender);
+      case SOCKMUX_SENDER_FLUSH_AUTO:
+      default:
+        /*
+         * Only filter streams such as GBufferedOutputStream hold data
+         * back; for everything else a flush is a no-op round trip.
+         */
+        if (G_IS_FILTER_OUTPUT_STREAM(sender->output))
+          return n_completed > 0;
+
+        return FALSE;
+    }
 }
 
+/* reports a message of sockmux_sender_send_async() as written */
 static void
-feed_output_stream (SockMuxSender *sender)
+sockmux_async_complete (SockMuxAsync *async)
 {
-  guint size;
-  SockMuxAsync *async = NULL;
-
-  if (g_output_stream_has_pending(sender->output))
+  if (async->task == NULL)
     return;
 
-  g_mutex_lock(sender->mutex);
-  if (sender->output_queue)
-    async = sender->output_queue->data;
-  g_mutex_unlock(sender->mutex);
+  g_task_return_boolean(async->task, TRUE);
+  g_object_unref(async->task);
+  async->task = NULL;
+}
+
+/* bytes covered by the write in flight, must be called with the mutex held */
+static gsize
+sockmux_sender_batch_size (SockMuxSender *sender)
+{
+  gsize size = 0;
+  guint i;
+
+  for (i = 0; i < sender->n_batch; i++)
+    size += sender->batch_size[i];
+
+  return size;
+}
 
-  if (async == NULL)
+/* Must be called with the mutex held. */
+static void
+sockmux_sender_count_sent (SockMuxSender *sender,
+                           SockMuxAsync  *async,
+                           gint64         now)
+{
+  if (async->control)
     return;
 
-  size = async->array->len - async->offset;
-  if (size > sender->max_chunk_size)
-    size = sender->max_chunk_size;
+  SOCKMUX_TRACE3(message_sent, sender, async->message_id, now - async->queued_at);
 
-  g_output_stream_write_async(sender->output,
-                              async->array->data + async->offset,
-                              size, G_PRIORITY_DEFAULT,
-                              sender->output_cancellable,
-                              async_write_cb, async);
+  sender->stats.messages_sent++;
+  sender->stats.bytes_sent += async->credit_size;
+  sockmux_stats_histogram_add(sender->stats.size_histogram, async->credit_size);
+  sockmux_stats_histogram_add(sender->stats.latency_histogram,
+                              now - async->queued_at);
+  sockmux_stats_count_id(sender->id_stats, async->message_id, async->credit_size);
 }
 
+/* Must be called with the mutex held. */
 static void
-sockmux_sender_queue (SockMuxSender *sender,
-                      gconstpointer  data1,
-                      guint          size1,
-                      gconstpointer  data2,
-                      guint          size2)
+sockmux_sender_update_peak (SockMuxSender *sender)
 {
-  SockMuxAsync *async = g_new0(SockMuxAsync, 1);
-  async->sender = g_object_ref(sender);
-  async->array = g_byte_array_sized_new(size1 + size2);
-  g_byte_array_append(async->array, (guint8 *) data1, size1);
-  if (data2)
-    g_byte_array_append(async->array, (guint8 *) data2, size2);
+  gsize size = sender->output_queue_size + sender->blocked_size;
 
-  g_mutex_lock(sender->mutex);
-  sender->output_queue = g_slist_append(sender->output_queue, async);
-  g_mutex_unlock(sender->mutex);
-
-  feed_output_stream(sender);
+  sender->stats.queue_size_peak = MAX(sender->stats.queue_size_peak, size);
 }
 
-static guint
-sockmux_sender_queue_size (SockMuxSender *sender)
+/*
+ * Returns the signal to emit if the queue just crossed a watermark, or
+ * -1. Must be called with the mutex held, the signal is emitted with
+ * sockmux_sender_emit() once it is released.
+ */
+static gint
+sockmux_sender_check_watermarks (SockMuxSender *sender)
 {
-  guint size = 0;
-  GSList *iter;
+  gsize size = sender->output_queue_size + sender->blocked_size;
 
-  g_mutex_lock(sender->mutex);
-  for (iter = sender->output_queue; iter; iter = iter->next)
+  if (!sender->full && sender->high_watermark > 0 &&
+      size >= sender->high_watermark)
     {
-      SockMuxAsync *async = iter->data;
-      size += async->array->len - async->offset;
+      sender->full = TRUE;
+      return SIGNAL_QUEUE_FULL;
     }
-  g_mutex_unlock(sender->mutex);
 
-  return size;
+  if (sender->full && size <= sender->low_watermark)
+    {
+      sender->full = FALSE;
+      return SIGNAL_WRITABLE;
+    }
+
+  return -1;
 }
 
 static void
-sockmux_sender_flush_queue (SockMuxSender *sender)
+sockmux_sender_emit (SockMuxSender *sender,
+                     gint           signal)
 {
-  GSList *iter;
+  if (signal >= 0)
+    g_signal_emit(sender, signals[signal], 0);
+}
 
-  g_mutex_lock(sender->mutex);
-  for (iter = sender->output_queue; iter; iter = iter->next)
+static void
+sockmux_async_free (SockMuxAsync *async)
+{
+  if (async->task)
     {
-      SockMuxAsync *async = iter->data;
-      g_byte_array_free(async->array, TRUE);
-      g_object_unref(async->sender);
+      g_task_return_new_error(async->task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                              "The message was dropped from the queue");
+      g_object_unref(async->task);
     }
 
-  g_slist_free_full(sender->output_queue, g_free);
-  sender->output_queue = NULL;
-  g_mutex_unlock(sender->mutex);
+  if (async->payload)
+    g_bytes_unref(async->payload);
+
+  sockmux_pool_free(async->buffer, async->buffer_size);
+
+  if (async->source)
+    g_object_unref(async->source);
+
+  if (async->close_source_fd)
+    close(async->source_fd);
+
+  g_object_unref(async->sender);
+  sockmux_pool_free(async, sizeof(*async));
 }
 
-void
-sockmux_sender_send (SockMuxSender  *sender,
-                     guint           message_id,
-                     gconstpointer   data,
-                     gsize           size)
+static void
+sockmux_async_free_queue (GQueue *queue)
 {
-  SockMuxMessage msg;
-  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+  GList *link;
 
-  if (sender->max_output_queue > 0 &&
-      sockmux_sender_queue_size(sender) > sender->max_output_queue)
+  while ((link = g_queue_pop_head_link(queue)))
+    sockmux_async_free(link->data);
+}
+
+/* copies @size bytes of payload into a buffer of the entry's own */
+static void
+sockmux_async_copy_data (SockMuxAsync  *async,
+                         gconstpointer  data,
+                         gsize          size)
+{
+  async->buffer = sockmux_pool_alloc(size);
+  async->buffer_size = size;
+  memcpy(async->buffer, data, size);
+  async->data = async->buffer;
+}
+
+static gboolean
+sockmux_async_has_source (SockMuxAsync *async)
+{
+  return async->source != NULL || async->source_fd >= 0;
+}
+
+/*
+ * Finds the frame that the wire offset @offset of a message falls into,
+ * and the position within that frame. Unfragmented messages consist of
+ * a single frame.
+ */
+static gsize
+sockmux_async_frame (SockMuxAsync *async,
+                     gsize         offset,
+                     gsize        *pos)
+{
+  gsize stride;
+
+  if (async->frame_size == 0)
     {
-      g_signal_emit(sender, signals[SIGNAL_STREAM_OVERFLOW], 0);
-      return;
+      *pos = offset;
+      return 0;
     }
 
-  msg.magic = GUINT_TO_BE(sender->magic);
-  msg.message_id = GUINT_TO_BE(message_id);
-  msg.length = GUINT_TO_BE(size);
-  sockmux_sender_queue(sender, (gconstpointer) &msg, sizeof(msg), data, size);
+  stride = async->header_size + async->frame_size;
+  *pos = offset % stride;
+
+  return offset / stride;
 }
 
-void
-sockmux_sender_set_max_output_queue (SockMuxSender *sender,
-                                     guint max_output_queue)
+static gsize
+sockmux_async_frame_length (SockMuxAsync *async,
+                            gsize         frame)
 {
-  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
-  sender->max_output_queue = max_output_queue;
+  if (async->frame_size == 0)
+    return async->length;
+
+  return MIN(async->frame_size, async->length - frame * async->frame_size);
 }
 
-void
-sockmux_sender_reset (SockMuxSender *sender)
+/* the number of bytes left until the end of the current frame */
+static gsize
+sockmux_async_frame_remaining (SockMuxAsync *async)
 {
-  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
-  sockmux_sender_flush_queue(sender);
-  g_output_stream_flush(sender->output, NULL, NULL);
-  g_output_stream_clear_pending(sender->output);
+  gsize pos, frame = sockmux_async_frame(async, async->offset, &pos);
+
+  return async->header_size + sockmux_async_frame_length(async, frame) - pos;
 }
 
 static void
-sockmux_sender_init (SockMuxSender *sender)
+sockmux_async_fill_frame (SockMuxAsync *async,
+                          gsize         frame)
 {
-  sender->output_cancellable = g_cancellable_new();
-  sender->mutex = g_mutex_new();
-  sender->max_chunk_size = DEFAULT_MAX_CHUNK_SIZE;
+  SockMuxFrame *hdr = &async->header.frame;
+  gsize len = sockmux_async_frame_length(async, frame);
+
+  hdr->length = GUINT_TO_BE(len);
+  hdr->flags = async->frame_flags;
+
+  if (frame == 0)
+    hdr->flags |= SOCKMUX_FRAME_BEGIN;
+
+  if (frame * async->frame_size + len == async->length)
+    hdr->flags |= SOCKMUX_FRAME_END;
 }
 
-SockMuxSender *sockmux_sender_new (GOutputStream *stream,
-                                   guint magic)
+/* returns the vectors for what is left of the current frame */
+static guint
+sockmux_async_get_vectors (SockMuxAsync  *async,
+                           GOutputVector *vectors,
+                           gsize          max_size)
 {
-  SockMuxSender *sender = g_object_new(SOCKMUX_TYPE_SENDER, NULL);
-  SockMuxHandshake hs;
+  gsize pos, frame = sockmux_async_frame(async, async->offset, &pos);
+  gsize start = frame * async->frame_size;
+  gsize end = start + sockmux_async_frame_length(async, frame);
+  guint n = 0;
 
-  sender->output = stream;
-  sender->magic = magic;
+  if (pos < async->header_size)
+    {
+      if (async->frame_size > 0)
+        sockmux_async_fill_frame(async, frame);
+
+      vectors[n].buffer = (const guint8 *) &async->header + pos;
+      vectors[n].size = MIN(async->header_size - pos, max_size);
+      max_size -= vectors[n].size;
+      pos = async->header_size;
+      n++;
+    }
 
-  /* send protocol handshake */
-  hs.magic = GUINT_TO_BE(sender->magic);
-  hs.protocol_version = GUINT_TO_BE(PROTOCOL_VERSION);
-  sockmux_sender_queue(sender, (gconstpointer) &hs, sizeof(hs), NULL, 0);
+  start += pos - async->header_size;
 
-  return sender;
+  if (async->data && start < end && max_size > 0)
+    {
+      vectors[n].buffer = async->data + start - async->data_skip;
+      vectors[n].size = MIN(end - start, max_size);
+      n++;
+    }
+
+  return n;
 }
 
+/*
+ * Accounts for @len bytes written of the batch set up by
+ * sockmux_sender_get_vectors() or sockmux_sender_feed_body(), and moves
+ * the entries that are complete to @done. Must be called with the
+ * mutex held.
+ */
 static void
-sockmux_sender_finalize (GObject *object)
+sockmux_sender_complete_batch (SockMuxSender *sender,
+                               gsize          len,
+                               GQueue        *done)
 {
-  SockMuxSender *sender = SOCKMUX_SENDER(object);
+  gsize written = len, requested = sockmux_sender_batch_size(sender);
+  SockMuxAsync *async;
+  gint64 now = 0;
+  guint i;
 
-  sockmux_sender_flush_queue(sender);
+  /* the write may have covered any number of coalesced messages and frames */
+  sender->output_queue_size -= len;
+  sender->current = NULL;
 
-  if (sender->output_cancellable)
+  for (i = 0; i < sender->n_batch; i++)
     {
-      g_object_unref(sender->output_cancellable);
-      sender->output_cancellable = NULL;
+      gsize count = MIN(len, sender->batch_size[i]), pos;
+
+      async = sender->batch[i];
+      async->offset += count;
+      len -= count;
+
+      if (async->offset == async->size)
+        {
+          if (now == 0)
+            now = g_get_monotonic_time();
+
+          sockmux_sender_count_sent(sender, async, now);
+          g_queue_unlink(&sender->lanes[async->lane], &async->link);
+          g_queue_push_tail_link(done, &async->link);
+          sender->output_queue_length--;
+        }
+      else if (sender->current == NULL)
+        {
+          /* a frame that was started has to be finished before anything else */
+          sockmux_async_frame(async, async->offset, &pos);
+          if (pos > 0)
+            sender->current = async;
+        }
     }
 
-  if (sender->mutex)
+  SOCKMUX_TRACE3(write_done, sender, requested, written);
+
+  sender->n_batch = 0;
+  sender->stats.write_calls++;
+  sender->stats.bytes_written += written;
+  if (written < requested)
+    sender->stats.partial_writes++;
+
+  if (sender->output_queue_length == 0)
+    sender->delay_expired = FALSE;
+}
+
+/*
+ * Accounts for @len bytes written by the operation that just finished
+ * and starts the next one. Takes over the operation's reference on
+ * @sender and @error, if any.
+ */
+static void
+sockmux_sender_write_done (SockMuxSender *sender,
+                           gsize          len,
+                           GError        *error)
+{
+  gsize written = len;
+  gboolean flush = FALSE;
+  GQueue done = G_QUEUE_INIT;
+  GList *link;
+  gint signal;
+
+  g_mutex_lock(&sender->mutex);
+  sockmux_sender_complete_batch(sender, len, &done);
+
+  if (error == NULL)
+    flush = sockmux_sender_should_flush(sender, written,
+                                        g_queue_get_length(&done));
+  if (flush)
+    sender->unflushed = 0;
+  else
+    sender->busy = FALSE;
+
+  signal = sockmux_sender_check_watermarks(sender);
+  g_mutex_unlock(&sender->mutex);
+
+  for (link = done.head; link; link = link->next)
+    sockmux_async_complete(link->data);
+
+  sockmux_async_free_queue(&done);
+  sockmux_sender_emit(sender, signal);
+
+  if (error)
+    {
+      /* a cancelled write means the queue was reset, carry on with what's new */
+      if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        feed_output_stream(sender);
+      else
+        {
+          g_critical("%s() %s", __func__, error->message);
+          g_signal_emit(sender, signals[SIGNAL_WRITE_ERROR], 0);
+        }
+
+      g_error_free(error);
+    }
+  else if (flush)
     {
-      g_mutex_free(sender->mutex);
-      sender->mutex = NULL;
+      SOCKMUX_TRACE1(flush_start, sender);
+      g_output_stream_flush_async(sender->output,
+                                  G_PRIORITY_DEFAULT,
+                                  NULL,
+                                  async_flush_cb, sender);
+      return;
     }
+  else
+    feed_output_stream(sender);
 
-  G_OBJECT_CLASS (parent_class)->finalize (object);
+  g_object_unref(sender);
 }
 
 static void
-sockmux_sender_class_init (SockMuxSenderClass *klass)
+async_write_cb (GObject      *source,
+                GAsyncResult *result,
+                gpointer      data)
 {
-  GObjectClass *object_class;
-  GParamSpec *pspec;
-
-  parent_class = (GObjectClass *) g_type_class_peek_parent (klass);
-  object_class = (GObjectClass *) klass;
+  gsize len = 0;
+  GError *error = NULL;
+  SockMuxSender *sender = SOCKMUX_SENDER(data);
 
-  object_class->get_property = sockmux_sender_get_property;
-  object_class->set_property = sockmux_sender_set_property;
-  object_class->finalize = sockmux_sender_finalize;
+  /* FIXME: is there really no clean solution to cancel a pending async operation!? */
+  if (g_output_stream_is_closing(G_OUTPUT_STREAM(source)) ||
+      g_output_stream_is_closed(G_OUTPUT_STREAM(source)))
+    {
+      g_object_unref(sender);
+      return;
+    }
 
-  pspec = g_param_spec_int(SOCKMUX_SENDER_PROP_MAX_OUTPUT_QUEUE,
-                           "The maximum length of the output queue",
-                           "Get the number",
-                           0, G_MAXINT, 0,
-                           G_PARAM_READWRITE);
-  g_object_class_install_property (object_class, PROP_MAX_OUTPUT_QUEUE, pspec);
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
 
-  pspec = g_param_spec_int(SOCKMUX_SENDER_PROP_MAX_CHUNK_SIZE,
-                           "The maximum size of a single data block to queue",
-                           "Get the number",
-                           0, G_MAXINT, DEFAULT_MAX_CHUNK_SIZE,
-                           G_PARAM_READWRITE);
-  g_object_class_install_property (object_class, PROP_MAX_CHUNK_SIZE, pspec);
+  if (g_output_stream_writev_finish(sender->output, result, &len, &error) &&
+      len == 0)
+    error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_FAILED,
+                                "Sender write error");
 
-  signals[SIGNAL_WRITE_ERROR] =
-    g_signal_new ("write-error",
-                  G_OBJECT_CLASS_TYPE (klass),
-                  G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
-                  0,
-                  NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+  sockmux_sender_write_done(sender, len, error);
+}
+
+static void
+async_body_write_cb (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      data)
+{
+  gsize len = 0;
+  GError *error = NULL;
+  SockMuxSender *sender = SOCKMUX_SENDER(data);
+
+  if (g_output_stream_is_closing(G_OUTPUT_STREAM(source)) ||
+      g_output_stream_is_closed(G_OUTPUT_STREAM(source)))
+    {
+      g_object_unref(sender);
+      return;
+    }
+
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+
+  g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), result, &len, &error);
+  sockmux_sender_write_done(sender, len, error);
+}
+
+/*
+ * The source of a message body failed or ended early. The header is
+ * out, so the peer waits for the rest of the body, and nothing else can
+ * be sent in its place: the queue is dropped, and the sender refuses
+ * all further messages. Takes over the operation's reference on @sender
+ * and @error.
+ */
+static void
+sockmux_sender_body_failed (SockMuxSender *sender,
+                            GError        *error)
+{
+  /* a cancelled read means the queue was reset, carry on with what's new */
+  if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      sockmux_sender_write_done(sender, 0, error);
+      return;
+    }
+
+  g_critical("%s() %s", __func__, error->message);
+  g_error_free(error);
+
+  /* busy stays set, so nothing is written any more */
+  g_atomic_int_set(&sender->broken, TRUE);
+  sockmux_sender_flush_queue(sender);
+  g_signal_emit(sender, signals[SIGNAL_WRITE_ERROR], 0);
+
+  g_object_unref(sender);
+}
+
+/* passes a chunk of a message body that was read into the bounce buffer on */
+static void
+sockmux_sender_write_body (SockMuxSender *sender,
+                           gssize         len,
+                           GError        *error)
+{
+  if (len == 0 && error == NULL)
+    error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                                "Message body source ended prematurely");
+
+  if (error)
+    {
+      sockmux_sender_body_failed(sender, error);
+      return;
+    }
+
+  g_output_stream_write_all_async(sender->output,
+                                  sender->body_buffer, len,
+                                  G_PRIORITY_DEFAULT,
+                                  sender->output_cancellable,
+                                  async_body_write_cb, sender);
+}
+
+static void
+async_body_read_cb (GObject      *source,
+                    GAsyncResult *result,
+                    gpointer      data)
+{
+  GError *error = NULL;
+  gssize len;
+
+  len = g_input_stream_read_finish(G_INPUT_STREAM(source), result, &error);
+  sockmux_sender_write_body(SOCKMUX_SENDER(data), len, error);
+}
+
+static gboolean
+sockmux_body_wait (gint fd,
+                   gshort events)
+{
+  struct pollfd pfd = { fd, events, 0 };
+
+  return poll(&pfd, 1, -1) >= 0 || errno == EINTR;
+}
+
+/*
+ * Moves one chunk from the source descriptor to the output descriptor
+ * without copying it through userspace where the kernel allows it, or
+ * just reads it into the bounce buffer if the output has no descriptor.
+ * Runs in a worker thread, so waiting for the descriptors is fine.
+ */
+static gssize
+sockmux_body_read (SockMuxBody *body)
+{
+  gssize ret;
+
+  for (;;)
+    {
+      ret = body->offset >= 0 ?
+              pread(body->in_fd, body->buffer, body->count, body->offset) :
+              read(body->in_fd, body->buffer, body->count);
+
+      if (ret >= 0 || (errno != EAGAIN && errno != EINTR))
+        return ret;
+
+      if (!sockmux_body_wait(body->in_fd, POLLIN))
+        return -1;
+    }
+}
+
+static gssize
+sockmux_body_transfer (SockMuxBody *body)
+{
+  gssize ret;
+
+  if (body->out_fd < 0)
+    return sockmux_body_read(body);
+
+  for (;;)
+    {
+#ifdef HAVE_SENDFILE
+      off_t off = body->offset;
+
+      ret = sendfile(body->out_fd, body->in_fd,
+                     body->offset >= 0 ? &off : NULL, body->count);
+      if (ret >= 0 || (errno != EINVAL && errno != ENOSYS))
+        goto check;
+#endif
+
+#ifdef HAVE_SPLICE
+      {
+        loff_t loff = body->offset;
+
+        /* works when either side is a pipe */
+        ret = splice(body->in_fd, body->offset >= 0 ? &loff : NULL,
+                     body->out_fd, NULL, body->count, SPLICE_F_MOVE);
+        if (ret >= 0 || (errno != EINVAL && errno != ENOSYS))
+          goto check;
+      }
+#endif
+
+      /* neither is possible for this pair of descriptors, copy the data */
+      ret = sockmux_body_read(body);
+      if (ret > 0)
+        {
+          gssize done = 0;
+
+          while (done < ret)
+            {
+              gssize n = write(body->out_fd, body->buffer + done, ret - done);
+
+              if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                sockmux_body_wait(body->out_fd, POLLOUT);
+              else if (n < 0)
+                return done > 0 ? done : -1;
+              else
+                done += n;
+            }
+        }
+
+      return ret;
+
+#if defined(HAVE_SENDFILE) || defined(HAVE_SPLICE)
+check:
+      if (ret >= 0)
+        return ret;
+
+      if (errno != EAGAIN && errno != EINTR)
+        return -1;
+
+      if (!sockmux_body_wait(body->in_fd, POLLIN) ||
+          !sockmux_body_wait(body->out_fd, POLLOUT))
+        return -1;
+#endif
+    }
+}
+
+static void
+sockmux_body_free (SockMuxBody *body)
+{
+  close(body->in_fd);
+  g_free(body);
+}
+
+static void
+body_transfer_thread (GTask        *task,
+                      gpointer      source_object,
+                      gpointer      task_data,
+                      GCancellable *cancellable)
+{
+  gssize ret = sockmux_body_transfer(task_data);
+
+  if (ret < 0)
+    {
+      int errsv = errno;
+      g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(errsv),
+                              "Error sending message body: %s", g_strerror(errsv));
+    }
+  else
+    g_task_return_int(task, ret);
+}
+
+static void
+async_body_transfer_cb (GObject      *source,
+                        GAsyncResult *result,
+                        gpointer      data)
+{
+  SockMuxSender *sender = SOCKMUX_SENDER(source);
+  SockMuxBody *body = g_task_get_task_data(G_TASK(result));
+  GError *error = NULL;
+  gssize len;
+
+  len = g_task_propagate_int(G_TASK(result), &error);
+
+  if (body->out_fd < 0)
+    {
+      sockmux_sender_write_body(sender, len, error);
+      return;
+    }
+
+  if (len == 0 && error == NULL)
+    error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                                "Message body source ended prematurely");
+
+  if (error)
+    {
+      sockmux_sender_body_failed(sender, error);
+      return;
+    }
+
+  sockmux_sender_write_done(sender, len, NULL);
+}
+
+/* must be called with the mutex held */
+static void
+sockmux_sender_feed_body (SockMuxSender *sender,
+                          SockMuxAsync  *async)
+{
+  gsize pos, frame = sockmux_async_frame(async, async->offset, &pos);
+  gsize body_offset = frame * async->frame_size + pos - async->header_size;
+  gsize count = MIN(sockmux_async_frame_remaining(async), sender->max_chunk_size);
+
+  sender->batch[0] = async;
+  sender->batch_size[0] = count;
+  sender->n_batch = 1;
+  SOCKMUX_TRACE3(write_start, sender, 0, count);
+
+  if (sender->body_buffer_size < count)
+    {
+      g_free(sender->body_buffer);
+      sender->body_buffer = g_malloc(count);
+      sender->body_buffer_size = count;
+    }
+
+  if (async->source_fd >= 0)
+    {
+      SockMuxBody *body = g_new0(SockMuxBody, 1);
+      GTask *task;
+
+      /* a reset may close the entry's descriptor while the thread runs */
+      body->out_fd = sender->output_fd;
+      body->in_fd = dup(async->source_fd);
+      body->offset = async->source_offset >= 0 ?
+                       async->source_offset + (goffset) body_offset : -1;
+      body->count = count;
+      body->buffer = sender->body_buffer;
+
+      task = g_task_new(sender, sender->output_cancellable,
+                        async_body_transfer_cb, NULL);
+      g_task_set_task_data(task, body, (GDestroyNotify) sockmux_body_free);
+      g_task_run_in_thread(task, body_transfer_thread);
+      g_object_unref(task);
+    }
+  else
+    g_input_stream_read_async(async->source,
+                              sender->body_buffer, count,
+                              G_PRIORITY_DEFAULT,
+                              sender->output_cancellable,
+                              async_body_read_cb, sender);
+}
+
+static gboolean
+delay_expired_cb (gpointer data)
+{
+  SockMuxSender *sender = SOCKMUX_SENDER(data);
+
+  g_mutex_lock(&sender->mutex);
+  sender->delay_source = NULL;
+  sender->delay_expired = TRUE;
+  g_mutex_unlock(&sender->mutex);
+
+  feed_output_stream(sender);
+
+  return FALSE;
+}
+
+/* must be called with the mutex held */
+static gboolean
+sockmux_sender_should_wait (SockMuxSender *sender)
+{
+  if (sender->output_queue_size >= sender->max_chunk_size)
+    return FALSE;
+
+  if (sender->corked)
+    return TRUE;
+
+  if (sender->max_delay == 0 || sender->delay_expired)
+    return FALSE;
+
+  /*
+   * Hold back small writes until more data arrives or the delay expires.
+   * The context keeps the source alive until it is destroyed or fires.
+   */
+  if (sender->delay_source == NULL)
+    {
+      sender->delay_source = g_timeout_source_new(sender->max_delay);
+      g_source_set_callback(sender->delay_source, delay_expired_cb,
+                            g_object_ref(sender), g_object_unref);
+      g_source_attach(sender->delay_source, sender->context);
+      g_source_unref(sender->delay_source);
+    }
+
+  return TRUE;
+}
+
+/*
+ * Picks what to write next: the rest of a frame that was started, then
+ * queued messages by priority, as many as fit into one chunk. Within a
+ * lane, messages are sent in order; a lane whose message has more
+ * frames to go yields to the lower ones until the next write, so a
+ * large message never holds back urgent ones for more than a frame.
+ * Without fragmentation, a message that does not fit ends the batch.
+ * Must be called with the mutex held.
+ */
+static guint
+sockmux_sender_get_vectors (SockMuxSender *sender)
+{
+  gsize max_size = sender->max_chunk_size;
+  guint i, n = 0;
+  gboolean stop = FALSE;
+
+  sender->n_batch = 0;
+
+  for (i = 0; i <= SOCKMUX_SENDER_N_PRIORITIES && !stop; i++)
+    {
+      guint lane;
+      GList *iter;
+
+      if (i == 0)
+        {
+          if (sender->current == NULL)
+            continue;
+
+          lane = sender->current->lane;
+        }
+      else
+        {
+          lane = i - 1;
+          if (sender->current && sender->current->lane == lane)
+            continue;
+        }
+
+      for (iter = sender->lanes[lane].head; iter; iter = iter->next)
+        {
+          SockMuxAsync *async = iter->data;
+          gsize frame_remaining, size = 0;
+          guint j, count;
+
+          if (max_size == 0 || n + 2 > MAX_OUTPUT_VECTORS)
+            {
+              stop = TRUE;
+              break;
+            }
+
+          frame_remaining = sockmux_async_frame_remaining(async);
+          count = sockmux_async_get_vectors(async,
+                                            sender->output_vectors + n,
+                                            max_size);
+
+          for (j = 0; j < count; j++)
+            size += sender->output_vectors[n + j].size;
+
+          if (count > 0)
+            {
+              sender->batch[sender->n_batch] = async;
+              sender->batch_size[sender->n_batch] = size;
+              sender->n_batch++;
+            }
+
+          n += count;
+          max_size -= size;
+
+          /* a body that is read from a source has to be sent on its own */
+          if (sockmux_async_has_source(async) || size < frame_remaining)
+            {
+              stop = TRUE;
+              break;
+            }
+
+          /* more frames of this message to go */
+          if (size < async->size - async->offset)
+            break;
+        }
+    }
+
+  return n;
+}
+
+static void
+feed_output_stream (SockMuxSender *sender)
+{
+  guint n_vectors;
+
+  /* blocking senders only write from sockmux_sender_send_sync() */
+  if (sender->blocking)
+    return;
+
+  /* in threaded mode, I/O is only ever started from the I/O thread */
+  if (sender->context && !g_main_context_is_owner(sender->context))
+    {
+      g_source_set_ready_time(sender->inbox_source, 0);
+      return;
+    }
+
+  g_mutex_lock(&sender->mutex);
+  if (sender->busy ||
+      sender->output_queue_length == 0 ||
+      sockmux_sender_should_wait(sender))
+    {
+      g_mutex_unlock(&sender->mutex);
+      return;
+    }
+
+  if (sender->delay_source)
+    {
+      g_source_destroy(sender->delay_source);
+      sender->delay_source = NULL;
+    }
+
+  /* the operation holds a reference until sockmux_sender_write_done() */
+  sender->busy = TRUE;
+  g_object_ref(sender);
+
+  n_vectors = sockmux_sender_get_vectors(sender);
+  if (n_vectors == 0)
+    {
+      /* the header is out, the body comes from a stream or descriptor */
+      sockmux_sender_feed_body(sender, sender->current);
+      g_mutex_unlock(&sender->mutex);
+      return;
+    }
+
+  SOCKMUX_TRACE3(write_start, sender, n_vectors, sockmux_sender_batch_size(sender));
+  g_mutex_unlock(&sender->mutex);
+
+  /*
+   * Header and payload go out in a single vectored write. Streams
+   * without native writev() support are served by GIO's fallback
+   * implementation, which writes the segments one after another.
+   */
+  g_output_stream_writev_async(sender->output,
+                               sender->output_vectors, n_vectors,
+                               G_PRIORITY_DEFAULT,
+                               sender->output_cancellable,
+                               async_write_cb, sender);
+}
+
+static SockMuxAsync *
+sockmux_async_new (SockMuxSender *sender,
+                   gconstpointer  header,
+                   gsize          header_size)
+{
+  SockMuxAsync *async = sockmux_pool_alloc(sizeof(*async));
+
+  g_assert(header_size <= sizeof(async->header));
+
+  memset(async, 0, sizeof(*async));
+  async->link.data = async;
+  async->sender = g_object_ref(sender);
+  memcpy(&async->header, header, header_size);
+  async->header_size = header_size;
+  async->size = header_size;
+  async->source_fd = -1;
+  async->control = TRUE;
+
+  return async;
+}
+
+static SockMuxAsync *
+sockmux_async_copy (const SockMuxAsync *template)
+{
+  SockMuxAsync *async = sockmux_pool_alloc(sizeof(*async));
+
+  *async = *template;
+  async->link.data = async;
+  g_object_ref(async->sender);
+
+  return async;
+}
+
+/*
+ * Sets up @async for a message with @length bytes of payload, without
+ * taking a reference on @sender. With protocol version 2, the message
+ * is split into frames that fit into max-chunk-size bytes each.
+ */
+static void
+sockmux_sender_init_message (SockMuxSender *sender,
+                             SockMuxAsync  *async,
+                             guint          message_id,
+                             guint          priority,
+                             gsize          length)
+{
+  memset(async, 0, sizeof(*async));
+
+  async->sender = sender;
+  async->message_id = message_id;
+  async->lane = MIN(priority, SOCKMUX_SENDER_N_PRIORITIES - 1);
+  async->length = length;
+  async->credit_size = length;
+  async->source_fd = -1;
+  async->queued_at = g_get_monotonic_time();
+
+  if (sender->protocol_version < 2)
+    {
+      SockMuxMessage *msg = &async->header.message;
+
+      msg->magic = GUINT_TO_BE(sender->magic);
+      msg->message_id = GUINT_TO_BE(message_id);
+      msg->length = GUINT_TO_BE(length);
+
+      async->header_size = sizeof(*msg);
+      async->size = async->header_size + length;
+    }
+  else
+    {
+      SockMuxFrame *frame = &async->header.frame;
+      gsize n_frames;
+
+      frame->magic = GUINT_TO_BE(sender->magic);
+      frame->message_id = GUINT_TO_BE(message_id);
+      frame->total_length = GUINT_TO_BE(length);
+      frame->lane = async->lane;
+
+      async->header_size = sizeof(*frame);
+      async->frame_size = sender->max_chunk_size > sizeof(*frame) ?
+                            sender->max_chunk_size - sizeof(*frame) : 1;
+
+      n_frames = MAX((length + async->frame_size - 1) / async->frame_size, 1);
+      async->size = n_frames * async->header_size + length;
+
+      sockmux_async_fill_frame(async, 0);
+    }
+}
+
+/* must be called with the mutex held */
+static void
+sockmux_sender_push_locked (SockMuxSender *sender,
+                            SockMuxAsync  *async)
+{
+  gsize pos;
+
+  g_queue_push_tail_link(&sender->lanes[async->lane], &async->link);
+  sender->output_queue_length++;
+  sender->output_queue_size += async->size - async->offset;
+  sockmux_sender_update_peak(sender);
+  SOCKMUX_TRACE4(enqueue, sender, async->message_id,
+                 async->size - async->offset, sender->output_queue_size);
+
+  /* the rest of a frame that was written synchronously goes first */
+  sockmux_async_frame(async, async->offset, &pos);
+  if (pos > 0)
+    sender->current = async;
+}
+
+static gboolean
+sockmux_channel_has_credit (SockMuxChannel *channel,
+                            SockMuxAsync   *async)
+{
+  return channel->credit >= (gint64) async->credit_size || channel->outstanding == 0;
+}
+
+/* the receiver only gives back credit for frames marked like this */
+static void
+sockmux_channel_charge (SockMuxChannel *channel,
+                        SockMuxAsync   *async)
+{
+  channel->credit -= async->credit_size;
+  channel->outstanding += async->credit_size;
+  async->frame_flags |= SOCKMUX_FRAME_CREDITED;
+}
+
+/*
+ * Charges a message to the credit of its channel. Returns FALSE if it
+ * has to wait for more credit. Must be called with the mutex held.
+ */
+static gboolean
+sockmux_sender_take_credit (SockMuxSender *sender,
+                            SockMuxAsync  *async)
+{
+  SockMuxChannel *channel;
+
+  /* flow control needs protocol version 2 on both ends */
+  if (async->control || sender->protocol_version < 2)
+    return TRUE;
+
+  channel = g_hash_table_lookup(sender->channels,
+                                GUINT_TO_POINTER(async->message_id));
+  if (channel == NULL)
+    return TRUE;
+
+  if (!g_queue_is_empty(&channel->pending) ||
+      !sockmux_channel_has_credit(channel, async))
+    return FALSE;
+
+  sockmux_channel_charge(channel, async);
+
+  return TRUE;
+}
+
+/* must be called with the mutex held */
+static void
+sockmux_sender_block_locked (SockMuxSender *sender,
+                             SockMuxAsync  *async)
+{
+  SockMuxChannel *channel = g_hash_table_lookup(sender->channels,
+                                                GUINT_TO_POINTER(async->message_id));
+
+  g_queue_push_tail_link(&channel->pending, &async->link);
+  sender->blocked_length++;
+  sender->blocked_size += async->size;
+  sockmux_sender_update_peak(sender);
+}
+
+/*
+ * Hands an entry to the I/O thread. Only the producer that finds the
+ * inbox empty has to wake it up; the others are picked up along with
+ * that one.
+ */
+static void
+sockmux_sender_post (SockMuxSender *sender,
+                     SockMuxAsync  *async)
+{
+  SockMuxAsync *head;
+
+  g_atomic_int_inc(&sender->inbox_length);
+  g_atomic_pointer_add(&sender->inbox_size, (gssize) async->size);
+
+  do
+    {
+      head = g_atomic_pointer_get(&sender->inbox);
+      async->next = head;
+    }
+  while (!g_atomic_pointer_compare_and_exchange(&sender->inbox, head, async));
+
+  if (head == NULL)
+    g_source_set_ready_time(sender->inbox_source, 0);
+}
+
+/* takes all posted entries, oldest first */
+static SockMuxAsync *
+sockmux_sender_take_inbox (SockMuxSender *sender)
+{
+  SockMuxAsync *async, *next, *list = NULL;
+  gsize size = 0;
+  gint length = 0;
+
+  do
+    async = g_atomic_pointer_get(&sender->inbox);
+  while (!g_atomic_pointer_compare_and_exchange(&sender->inbox, async, NULL));
+
+  for (; async; async = next)
+    {
+      next = async->next;
+      async->next = list;
+      list = async;
+
+      length++;
+      size += async->size;
+    }
+
+  g_atomic_int_add(&sender->inbox_length, -length);
+  g_atomic_pointer_add(&sender->inbox_size, -(gssize) size);
+
+  return list;
+}
+
+static void
+sockmux_sender_push (SockMuxSender *sender,
+                     SockMuxAsync  *async)
+{
+  gint signal;
+
+  if (g_atomic_int_get(&sender->broken))
+    {
+      sockmux_async_free(async);
+      return;
+    }
+
+  if (sender->context)
+    {
+      sockmux_sender_post(sender, async);
+      return;
+    }
+
+  g_mutex_lock(&sender->mutex);
+  if (sockmux_sender_take_credit(sender, async))
+    sockmux_sender_push_locked(sender, async);
+  else
+    sockmux_sender_block_locked(sender, async);
+  signal = sockmux_sender_check_watermarks(sender);
+  g_mutex_unlock(&sender->mutex);
+
+  sockmux_sender_emit(sender, signal);
+  feed_output_stream(sender);
+}
+
+static gboolean
+inbox_source_dispatch (GSource     *source,
+                       GSourceFunc  callback,
+                       gpointer     data)
+{
+  /* re-armed by the next producer that finds the inbox empty */
+  g_source_set_ready_time(source, -1);
+
+  return callback(data);
+}
+
+static GSourceFuncs inbox_source_funcs = {
+  .dispatch = inbox_source_dispatch,
+};
+
+static gboolean
+inbox_cb (gpointer data)
+{
+  SockMuxSender *sender = SOCKMUX_SENDER(data);
+  SockMuxAsync *async, *next;
+  gint signal;
+
+  /* under the mutex, so the entries are always accounted for somewhere */
+  g_mutex_lock(&sender->mutex);
+  async = sockmux_sender_take_inbox(sender);
+
+  for (; async; async = next)
+    {
+      next = async->next;
+      async->next = NULL;
+
+      if (sockmux_sender_take_credit(sender, async))
+        sockmux_sender_push_locked(sender, async);
+      else
+        sockmux_sender_block_locked(sender, async);
+    }
+
+  signal = sockmux_sender_check_watermarks(sender);
+  g_mutex_unlock(&sender->mutex);
+
+  sockmux_sender_emit(sender, signal);
+  feed_output_stream(sender);
+
+  return TRUE;
+}
+
+static gpointer
+sockmux_sender_thread (gpointer data)
+{
+  GMainLoop *loop = data;
+  GMainContext *context = g_main_loop_get_context(loop);
+
+  g_main_context_push_thread_default(context);
+  g_main_loop_run(loop);
+  g_main_context_pop_thread_default(context);
+
+  g_main_loop_unref(loop);
+
+  return NULL;
+}
+
+static gboolean
+sockmux_sender_thread_quit (gpointer data)
+{
+  g_main_loop_quit(data);
+
+  return FALSE;
+}
+
+/*
+ * If nothing is queued or in flight and the stream can take data without
+ * blocking, write as much of a message as possible right away instead of
+ * waiting for a main loop iteration. Must be called with the mutex held.
+ * Returns the number of bytes written.
+ */
+static gsize
+sockmux_sender_try_write (SockMuxSender *sender,
+                          GOutputVector *vectors,
+                          guint          n_vectors)
+{
+  GPollableOutputStream *pollable;
+  gsize written = 0, max_size = sender->max_chunk_size;
+  guint i;
+
+  if (!sender->fast_path ||
+      sender->busy ||
+      sender->corked ||
+      sender->max_delay > 0 ||
+      sender->output_queue_length > 0)
+    return 0;
+
+  /* don't block for longer than a regular chunk would */
+  for (i = 0; i < n_vectors; i++)
+    {
+      vectors[i].size = MIN(vectors[i].size, max_size);
+      max_size -= vectors[i].size;
+    }
+
+  pollable = G_POLLABLE_OUTPUT_STREAM(sender->output);
+  if (!g_pollable_output_stream_is_writable(pollable))
+    return 0;
+
+  if (g_pollable_output_stream_writev_nonblocking(pollable, vectors, n_vectors,
+                                                  &written, NULL, NULL) !=
+      G_POLLABLE_RETURN_OK)
+    return 0;
+
+  sender->stats.write_calls++;
+  sender->stats.fast_path_writes++;
+  sender->stats.bytes_written += written;
+
+  return written;
+}
+
+static void
+sockmux_sender_flush_queue (SockMuxSender *sender)
+{
+  GQueue queue = G_QUEUE_INIT;
+  GHashTableIter iter;
+  SockMuxChannel *channel;
+  SockMuxAsync *async, *next;
+  GList *link;
+  gint signal;
+  guint i;
+
+  g_mutex_lock(&sender->mutex);
+
+  /* entries the I/O thread has not picked up yet */
+  for (async = sockmux_sender_take_inbox(sender); async; async = next)
+    {
+      next = async->next;
+      g_queue_push_tail_link(&queue, &async->link);
+    }
+  for (i = 0; i < SOCKMUX_SENDER_N_PRIORITIES; i++)
+    {
+      while ((link = g_queue_pop_head_link(&sender->lanes[i])))
+        {
+          async = link->data;
+
+          /* the peer won't see these, so they don't use up any credit */
+          channel = g_hash_table_lookup(sender->channels,
+                                        GUINT_TO_POINTER(async->message_id));
+          if (channel && (async->frame_flags & SOCKMUX_FRAME_CREDITED))
+            {
+              channel->credit += async->credit_size;
+              channel->outstanding -= MIN(channel->outstanding, async->credit_size);
+            }
+
+          g_queue_push_tail_link(&queue, link);
+        }
+    }
+
+  g_hash_table_iter_init(&iter, sender->channels);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &channel))
+    {
+      while ((link = g_queue_pop_head_link(&channel->pending)))
+        g_queue_push_tail_link(&queue, link);
+    }
+
+  for (link = queue.head; link; link = link->next)
+    if (!((SockMuxAsync *) link->data)->control)
+      sender->stats.messages_dropped++;
+
+  sender->output_queue_length = 0;
+  sender->output_queue_size = 0;
+  sender->blocked_length = 0;
+  sender->blocked_size = 0;
+  sender->current = NULL;
+  sender->n_batch = 0;
+  signal = sockmux_sender_check_watermarks(sender);
+  g_mutex_unlock(&sender->mutex);
+
+  sockmux_async_free_queue(&queue);
+  sockmux_sender_emit(sender, signal);
+}
+
+static gboolean
+sockmux_sender_check_overflow (SockMuxSender *sender)
+{
+  if (sender->max_output_queue > 0 &&
+      sockmux_sender_get_queue_size(sender) > sender->max_output_queue)
+    {
+      g_mutex_lock(&sender->mutex);
+      sender->stats.messages_dropped++;
+      g_mutex_unlock(&sender->mutex);
+
+      g_signal_emit(sender, signals[SIGNAL_STREAM_OVERFLOW], 0);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/*
+ * Returns the compressed form of a message payload, or NULL if it would
+ * not be smaller than @size bytes.
+ */
+static GBytes *
+sockmux_sender_compress (SockMuxSender *sender,
+                         const guint8  *data,
+                         gsize          size)
+{
+  SockMuxCompressed *hdr;
+  GConverterResult res;
+  gsize in_pos = 0, out_pos = sizeof(*hdr), bytes_read, bytes_written;
+  guint8 *buf;
+
+  if (sender->compression == SOCKMUX_SENDER_COMPRESSION_NONE ||
+      !(sender->peer_capabilities & SOCKMUX_CAPABILITY_ZLIB) ||
+      sender->protocol_version < 2 ||
+      size < MAX(sender->compression_threshold, sizeof(*hdr) + 1) ||
+      sender->max_chunk_size < sizeof(SockMuxFrame) + sizeof(*hdr))
+    return NULL;
+
+  buf = g_malloc(size);
+
+  g_mutex_lock(&sender->compress_mutex);
+  if (sender->compressor == NULL)
+    sender->compressor = G_CONVERTER(g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB, -1));
+
+  g_converter_reset(sender->compressor);
+
+  /* the output buffer is only as large as the input, more is no use */
+  do
+    {
+      res = g_converter_convert(sender->compressor,
+                                data + in_pos, size - in_pos,
+                                buf + out_pos, size - out_pos,
+                                G_CONVERTER_INPUT_AT_END,
+                                &bytes_read, &bytes_written, NULL);
+      in_pos += bytes_read;
+      out_pos += bytes_written;
+    }
+  while (res == G_CONVERTER_CONVERTED && (bytes_read > 0 || bytes_written > 0));
+  g_mutex_unlock(&sender->compress_mutex);
+
+  if (res != G_CONVERTER_FINISHED)
+    {
+      g_free(buf);
+      return NULL;
+    }
+
+  hdr = (SockMuxCompressed *) buf;
+  hdr->length = GUINT_TO_BE(size);
+
+  return g_bytes_new_take(buf, out_pos);
+}
+
+/*
+ * Queues a message with @size bytes of payload at @data. If @bytes is
+ * given, it owns @data and is kept until the message is written;
+ * otherwise @data is borrowed, and whatever cannot be written right
+ * away is copied. With @task, the caller keeps @data valid until the
+ * task completes instead, and the message is never dropped for
+ * overflowing the queue.
+ */
+static void
+sockmux_sender_send_message (SockMuxSender *sender,
+                             guint          message_id,
+                             guint          priority,
+                             gconstpointer  data,
+                             gsize          size,
+                             GBytes        *bytes,
+                             GTask         *task)
+{
+  SockMuxAsync template, *async;
+  GOutputVector vectors[2];
+  gsize written, skip, credit_size = size;
+  guint n_vectors;
+  gboolean credited;
+  GBytes *compressed;
+  gint signal;
+
+  if (g_atomic_int_get(&sender->broken))
+    {
+      if (bytes)
+        g_bytes_unref(bytes);
+
+      if (task)
+        {
+          g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE,
+                                  "The stream is out of sync after a failed message body");
+          g_object_unref(task);
+        }
+
+      return;
+    }
+
+  if (task == NULL && sockmux_sender_check_overflow(sender))
+    {
+      if (bytes)
+        g_bytes_unref(bytes);
+
+      return;
+    }
+
+  compressed = sockmux_sender_compress(sender, data, size);
+  if (compressed)
+    {
+      if (bytes)
+        g_bytes_unref(bytes);
+
+      bytes = compressed;
+      data = g_bytes_get_data(compressed, &size);
+    }
+
+  sockmux_sender_init_message(sender, &template, message_id, priority, size);
+  template.data = data;
+
+  /* flow control accounts for the payload as the application sees it */
+  template.credit_size = credit_size;
+
+  if (compressed)
+    {
+      template.frame_flags = SOCKMUX_FRAME_COMPRESSED;
+      sockmux_async_fill_frame(&template, 0);
+    }
+
+  /* credit is checked by the I/O thread */
+  if (sender->context)
+    {
+      async = sockmux_async_copy(&template);
+
+      async->task = task;
+      async->payload = bytes;
+      if (bytes == NULL && task == NULL && size > 0)
+        sockmux_async_copy_data(async, data, size);
+
+      sockmux_sender_post(sender, async);
+      return;
+    }
+
+  g_mutex_lock(&sender->mutex);
+
+  /* only the first frame is written synchronously */
+  credited = sockmux_sender_take_credit(sender, &template);
+  if (credited)
+    {
+      n_vectors = sockmux_async_get_vectors(&template, vectors, G_MAXSIZE);
+      written = sockmux_sender_try_write(sender, vectors, n_vectors);
+      SOCKMUX_TRACE3(write_fast, sender, message_id, written);
+    }
+  else
+    written = 0;
+
+  if (written == template.size)
+    {
+      sockmux_sender_count_sent(sender, &template, template.queued_at);
+      g_mutex_unlock(&sender->mutex);
+
+      if (bytes)
+        g_bytes_unref(bytes);
+
+      if (task)
+        {
+          g_task_return_boolean(task, TRUE);
+          g_object_unref(task);
+        }
+
+      return;
+    }
+
+  /* queue the remainder, keeping the order with concurrent senders */
+  template.offset = written;
+  async = sockmux_async_copy(&template);
+  async->task = task;
+
+  if (bytes)
+    async->payload = bytes;
+  else if (task)
+    ; /* the caller keeps @data around */
+  else if (size > 0)
+    {
+      skip = written > async->header_size ? written - async->header_size : 0;
+      sockmux_async_copy_data(async, (const guint8 *) data + skip, size - skip);
+      async->data_skip = skip;
+    }
+  else
+    async->data = NULL;
+
+  if (credited)
+    sockmux_sender_push_locked(sender, async);
+  else
+    sockmux_sender_block_locked(sender, async);
+  signal = sockmux_sender_check_watermarks(sender);
+  g_mutex_unlock(&sender->mutex);
+
+  sockmux_sender_emit(sender, signal);
+  feed_output_stream(sender);
+}
+
+static void
+sockmux_sender_send_source (SockMuxSender *sender,
+                            guint          message_id,
+                            GInputStream  *source,
+                            gint           fd,
+                            goffset        offset,
+                            gsize          length)
+{
+  SockMuxAsync template, *async;
+
+  if (sockmux_sender_check_overflow(sender))
+    return;
+
+  sockmux_sender_init_message(sender, &template, message_id,
+                              SOCKMUX_SENDER_PRIORITY_DEFAULT, length);
+  async = sockmux_async_copy(&template);
+
+  if (source)
+    {
+      async->source = g_object_ref(source);
+
+      /* let the kernel move the data if the stream is backed by a descriptor */
+      if (G_IS_FILE_DESCRIPTOR_BASED(source))
+        {
+          async->source_fd = g_file_descriptor_based_get_fd(G_FILE_DESCRIPTOR_BASED(source));
+          async->source_offset = -1;
+        }
+    }
+  else if (length > 0)
+    {
+      async->source_fd = dup(fd);
+      async->source_offset = offset;
+      async->close_source_fd = TRUE;
+
+      if (async->source_fd < 0)
+        {
+          g_critical("%s(): unable to dup() fd %d", __func__, fd);
+          sockmux_async_free(async);
+          return;
+        }
+    }
+
+  sockmux_sender_push(sender, async);
+}
+
+void
+sockmux_sender_send (SockMuxSender  *sender,
+                     guint           message_id,
+                     gconstpointer   data,
+                     gsize           size)
+{
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+
+  sockmux_sender_send_message(sender, message_id,
+                              SOCKMUX_SENDER_PRIORITY_DEFAULT,
+                              data, size, NULL, NULL);
+}
+
+void
+sockmux_sender_send_priority (SockMuxSender  *sender,
+                              guint           message_id,
+                              guint           priority,
+                              gconstpointer   data,
+                              gsize           size)
+{
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+  g_return_if_fail(priority < SOCKMUX_SENDER_N_PRIORITIES);
+
+  sockmux_sender_send_message(sender, message_id, priority, data, size,
+                              NULL, NULL);
+}
+
+void
+sockmux_sender_send_bytes (SockMuxSender  *sender,
+                           guint           message_id,
+                           GBytes         *bytes)
+{
+  sockmux_sender_send_bytes_priority(sender, message_id,
+                                     SOCKMUX_SENDER_PRIORITY_DEFAULT, bytes);
+}
+
+void
+sockmux_sender_send_bytes_priority (SockMuxSender  *sender,
+                                    guint           message_id,
+                                    guint           priority,
+                                    GBytes         *bytes)
+{
+  gconstpointer data;
+  gsize size;
+
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+  g_return_if_fail(priority < SOCKMUX_SENDER_N_PRIORITIES);
+  g_return_if_fail(bytes != NULL);
+
+  /* the reference is held until the last byte has been written */
+  data = g_bytes_get_data(bytes, &size);
+  sockmux_sender_send_message(sender, message_id, priority, data, size,
+                              g_bytes_ref(bytes), NULL);
+}
+
+void
+sockmux_sender_send_take (SockMuxSender  *sender,
+                          guint           message_id,
+                          gpointer        data,
+                          gsize           size)
+{
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+
+  sockmux_sender_send_message(sender, message_id,
+                              SOCKMUX_SENDER_PRIORITY_DEFAULT, data, size,
+                              g_bytes_new_take(data, size), NULL);
+}
+
+void
+sockmux_sender_send_async (SockMuxSender       *sender,
+                           guint                message_id,
+                           gconstpointer        data,
+                           gsize                size,
+                           GCancellable        *cancellable,
+                           GAsyncReadyCallback  callback,
+                           gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+
+  task = g_task_new(sender, cancellable, callback, user_data);
+  g_task_set_source_tag(task, sockmux_sender_send_async);
+
+  /* once queued, the message goes out no matter what */
+  g_task_set_check_cancellable(task, FALSE);
+  if (g_task_return_error_if_cancelled(task))
+    {
+      g_object_unref(task);
+      return;
+    }
+
+  sockmux_sender_send_message(sender, message_id,
+                              SOCKMUX_SENDER_PRIORITY_DEFAULT, data, size,
+                              NULL, task);
+}
+
+gboolean
+sockmux_sender_send_finish (SockMuxSender  *sender,
+                            GAsyncResult   *result,
+                            GError        **error)
+{
+  g_return_val_if_fail(g_task_is_valid(result, sender), FALSE);
+
+  return g_task_propagate_boolean(G_TASK(result), error);
+}
+
+/*
+ * Writes the batch set up by sockmux_sender_get_vectors() with a
+ * blocking call. Must be called with the mutex held, which is released
+ * in the meantime.
+ */
+static gboolean
+sockmux_sender_write_batch_sync (SockMuxSender  *sender,
+                                 guint           n_vectors,
+                                 GQueue         *done,
+                                 GCancellable   *cancellable,
+                                 GError        **error)
+{
+  gsize written = 0;
+  gboolean ret;
+
+  g_mutex_unlock(&sender->mutex);
+  ret = g_output_stream_writev_all(sender->output,
+                                   sender->output_vectors, n_vectors,
+                                   &written, cancellable, error);
+  g_mutex_lock(&sender->mutex);
+
+  sockmux_sender_complete_batch(sender, written, done);
+
+  return ret;
+}
+
+gboolean
+sockmux_sender_send_sync (SockMuxSender  *sender,
+                          guint           message_id,
+                          gconstpointer   data,
+                          gsize           size,
+                          GCancellable   *cancellable,
+                          GError        **error)
+{
+  SockMuxAsync template;
+  GOutputVector vectors[2];
+  GQueue done = G_QUEUE_INIT;
+  GBytes *compressed;
+  GList *link;
+  gsize written, total = 0, credit_size = size;
+  gboolean ret = TRUE, flush = FALSE;
+  guint n_vectors, n_writes = 0;
+  gint signal;
+
+  g_return_val_if_fail(SOCKMUX_IS_SENDER(sender), FALSE);
+  g_return_val_if_fail(sender->blocking, FALSE);
+
+  if (g_atomic_int_get(&sender->broken))
+    {
+      g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE,
+                          "The stream is out of sync after a failed message body");
+      return FALSE;
+    }
+
+  compressed = sockmux_sender_compress(sender, data, size);
+  if (compressed)
+    data = g_bytes_get_data(compressed, &size);
+
+  sockmux_sender_init_message(sender, &template, message_id,
+                              SOCKMUX_SENDER_PRIORITY_DEFAULT, size);
+  template.data = data;
+  template.credit_size = credit_size;
+
+  if (compressed)
+    {
+      template.frame_flags = SOCKMUX_FRAME_COMPRESSED;
+      sockmux_async_fill_frame(&template, 0);
+    }
+
+  g_mutex_lock(&sender->mutex);
+
+  while (sender->syncing)
+    g_cond_wait(&sender->sync_cond, &sender->mutex);
+
+  /* messages sent otherwise meanwhile queue up, and keep off the fast path */
+  sender->syncing = TRUE;
+  sender->busy = TRUE;
+
+  /* whatever was queued before, the handshake at least, goes first */
+  while (ret && sender->output_queue_length > 0)
+    {
+      n_vectors = sockmux_sender_get_vectors(sender);
+      if (n_vectors == 0)
+        {
+          g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                              "Message bodies from a source can't be written blocking");
+          sender->n_batch = 0;
+          ret = FALSE;
+          break;
+        }
+
+      ret = sockmux_sender_write_batch_sync(sender, n_vectors, &done,
+                                            cancellable, error);
+    }
+
+  if (ret && !sockmux_sender_take_credit(sender, &template))
+    {
+      g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+                          "The peer has not granted credit for the message ID");
+      ret = FALSE;
+    }
+
+  g_mutex_unlock(&sender->mutex);
+
+  /* the message itself, one frame per write */
+  while (ret && template.offset < template.size)
+    {
+      n_vectors = sockmux_async_get_vectors(&template, vectors, G_MAXSIZE);
+      written = 0;
+      ret = g_output_stream_writev_all(sender->output, vectors, n_vectors,
+                                       &written, cancellable, error);
+      template.offset += written;
+      total += written;
+      n_writes++;
+    }
+
+  g_mutex_lock(&sender->mutex);
+
+  sender->stats.write_calls += n_writes;
+  sender->stats.bytes_written += total;
+  if (ret)
+    {
+      sockmux_sender_count_sent(sender, &template, g_get_monotonic_time());
+      flush = sockmux_sender_should_flush(sender, total, 1);
+      if (flush)
+        sender->unflushed = 0;
+    }
+
+  g_mutex_unlock(&sender->mutex);
+
+  if (flush)
+    ret = g_output_stream_flush(sender->output, cancellable, error);
+
+  g_mutex_lock(&sender->mutex);
+  sender->syncing = FALSE;
+  sender->busy = FALSE;
+  g_cond_signal(&sender->sync_cond);
+  signal = sockmux_sender_check_watermarks(sender);
+  g_mutex_unlock(&sender->mutex);
+
+  for (link = done.head; link; link = link->next)
+    sockmux_async_complete(link->data);
+
+  sockmux_async_free_queue(&done);
+  sockmux_sender_emit(sender, signal);
+
+  if (compressed)
+    g_bytes_unref(compressed);
+
+  return ret;
+}
+
+void
+sockmux_sender_send_stream (SockMuxSender  *sender,
+                            guint           message_id,
+                            GInputStream   *source,
+                            gsize           length)
+{
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+  g_return_if_fail(G_IS_INPUT_STREAM(source));
+
+  sockmux_sender_send_source(sender, message_id, source, -1, 0, length);
+}
+
+void
+sockmux_sender_send_fd (SockMuxSender  *sender,
+                        guint           message_id,
+                        gint            fd,
+                        goffset         offset,
+                        gsize           length)
+{
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+  g_return_if_fail(fd >= 0);
+  g_return_if_fail(offset >= -1);
+
+  sockmux_sender_send_source(sender, message_id, NULL, fd, offset, length);
+}
+
+void
+sockmux_sender_cork (SockMuxSender *sender)
+{
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+
+  g_mutex_lock(&sender->mutex);
+  sender->corked++;
+  g_mutex_unlock(&sender->mutex);
+}
+
+void
+sockmux_sender_uncork (SockMuxSender *sender)
+{
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+
+  g_mutex_lock(&sender->mutex);
+  if (G_LIKELY(sender->corked > 0) && --sender->corked == 0)
+    {
+      /* the batch is complete, don't hold it back any longer */
+      if (sender->output_queue_length > 0)
+        sender->delay_expired = TRUE;
+    }
+  g_mutex_unlock(&sender->mutex);
+
+  feed_output_stream(sender);
+}
+
+gsize
+sockmux_sender_get_queue_size (SockMuxSender *sender)
+{
+  gsize size;
+
+  g_return_val_if_fail(SOCKMUX_IS_SENDER(sender), 0);
+
+  g_mutex_lock(&sender->mutex);
+  size = sender->output_queue_size + sender->blocked_size +
+         g_atomic_pointer_get(&sender->inbox_size);
+  g_mutex_unlock(&sender->mutex);
+
+  return size;
+}
+
+guint
+sockmux_sender_get_queue_length (SockMuxSender *sender)
+{
+  guint length;
+
+  g_return_val_if_fail(SOCKMUX_IS_SENDER(sender), 0);
+
+  g_mutex_lock(&sender->mutex);
+  length = sender->output_queue_length + sender->blocked_length +
+           g_atomic_int_get(&sender->inbox_length);
+  g_mutex_unlock(&sender->mutex);
+
+  return length;
+}
+
+void
+sockmux_sender_get_stats (SockMuxSender      *sender,
+                          SockMuxSenderStats *stats)
+{
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+  g_return_if_fail(stats != NULL);
+
+  g_mutex_lock(&sender->mutex);
+  *stats = sender->stats;
+  stats->queue_length = sender->output_queue_length + sender->blocked_length +
+                        g_atomic_int_get(&sender->inbox_length);
+  stats->queue_size = sender->output_queue_size + sender->blocked_size +
+                      g_atomic_pointer_get(&sender->inbox_size);
+  g_mutex_unlock(&sender->mutex);
+}
+
+GVariant *
+sockmux_sender_get_stats_variant (SockMuxSender *sender)
+{
+  SockMuxSenderStats stats;
+  GVariantBuilder builder;
+  GVariant *ids, *other;
+
+  g_return_val_if_fail(SOCKMUX_IS_SENDER(sender), NULL);
+
+  sockmux_sender_get_stats(sender, &stats);
+
+  g_mutex_lock(&sender->mutex);
+  ids = sockmux_stats_ids_variant(sender->id_stats);
+  other = sockmux_stats_other_variant(sender->id_stats);
+  g_mutex_unlock(&sender->mutex);
+
+  g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add(&builder, "{sv}", "messages-sent",
+                        g_variant_new_uint64(stats.messages_sent));
+  g_variant_builder_add(&builder, "{sv}", "bytes-sent",
+                        g_variant_new_uint64(stats.bytes_sent));
+  g_variant_builder_add(&builder, "{sv}", "bytes-written",
+                        g_variant_new_uint64(stats.bytes_written));
+  g_variant_builder_add(&builder, "{sv}", "write-calls",
+                        g_variant_new_uint64(stats.write_calls));
+  g_variant_builder_add(&builder, "{sv}", "partial-writes",
+                        g_variant_new_uint64(stats.partial_writes));
+  g_variant_builder_add(&builder, "{sv}", "fast-path-writes",
+                        g_variant_new_uint64(stats.fast_path_writes));
+  g_variant_builder_add(&builder, "{sv}", "messages-dropped",
+                        g_variant_new_uint64(stats.messages_dropped));
+  g_variant_builder_add(&builder, "{sv}", "queue-length",
+                        g_variant_new_uint32(stats.queue_length));
+  g_variant_builder_add(&builder, "{sv}", "queue-size",
+                        g_variant_new_uint64(stats.queue_size));
+  g_variant_builder_add(&builder, "{sv}", "queue-size-peak",
+                        g_variant_new_uint64(stats.queue_size_peak));
+  g_variant_builder_add(&builder, "{sv}", "size-histogram",
+                        sockmux_stats_histogram_variant(stats.size_histogram));
+  g_variant_builder_add(&builder, "{sv}", "latency-histogram",
+                        sockmux_stats_histogram_variant(stats.latency_histogram));
+  g_variant_builder_add(&builder, "{sv}", "message-ids", ids);
+  g_variant_builder_add(&builder, "{sv}", "other-message-ids", other);
+
+  return g_variant_builder_end(&builder);
+}
+
+static void
+sockmux_channel_free (SockMuxChannel *channel)
+{
+  sockmux_async_free_queue(&channel->pending);
+  g_free(channel);
+}
+
+void
+sockmux_sender_add_credit (SockMuxSender *sender,
+                           guint          message_id,
+                           guint          credit)
+{
+  SockMuxChannel *channel;
+  SockMuxAsync *async;
+  GList *link;
+
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+
+  g_mutex_lock(&sender->mutex);
+  channel = g_hash_table_lookup(sender->channels, GUINT_TO_POINTER(message_id));
+  if (channel == NULL)
+    {
+      channel = g_new0(SockMuxChannel, 1);
+      g_hash_table_insert(sender->channels, GUINT_TO_POINTER(message_id), channel);
+    }
+
+  /* a larger window shows up as credit that was never charged */
+  channel->credit += credit;
+  channel->outstanding -= MIN(channel->outstanding, credit);
+
+  /* release waiting messages in order for as long as the credit lasts */
+  while ((link = g_queue_peek_head_link(&channel->pending)) &&
+         sockmux_channel_has_credit(channel, link->data))
+    {
+      g_queue_unlink(&channel->pending, link);
+      async = link->data;
+      sockmux_channel_charge(channel, async);
+      sender->blocked_length--;
+      sender->blocked_size -= async->size;
+      sockmux_sender_push_locked(sender, async);
+    }
+  g_mutex_unlock(&sender->mutex);
+
+  feed_output_stream(sender);
+}
+
+void
+sockmux_sender_send_credit (SockMuxSender *sender,
+                            guint          message_id,
+                            guint          credit)
+{
+  SockMuxAsync template, *async;
+  SockMuxCredit payload;
+
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+
+  if (sender->protocol_version < 2)
+    {
+      g_warning("%s(): flow control needs protocol version 2", __func__);
+      return;
+    }
+
+  /* control frames are never fragmented and bypass flow control */
+  sockmux_sender_init_message(sender, &template, message_id,
+                              SOCKMUX_SENDER_PRIORITY_HIGH, sizeof(payload));
+  template.control = TRUE;
+  template.frame_size = sizeof(payload);
+  template.size = template.header_size + sizeof(payload);
+  template.frame_flags = SOCKMUX_FRAME_CONTROL;
+  sockmux_async_fill_frame(&template, 0);
+
+  payload.credit = GUINT_TO_BE(credit);
+
+  async = sockmux_async_copy(&template);
+  sockmux_async_copy_data(async, &payload, sizeof(payload));
+
+  sockmux_sender_push(sender, async);
+}
+
+void
+sockmux_sender_set_peer_capabilities (SockMuxSender *sender,
+                                      guint          capabilities)
+{
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+
+  g_mutex_lock(&sender->compress_mutex);
+  sender->peer_capabilities = capabilities;
+  g_mutex_unlock(&sender->compress_mutex);
+}
+
+void
+sockmux_sender_set_max_output_queue (SockMuxSender *sender,
+                                     guint max_output_queue)
+{
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+  sender->max_output_queue = max_output_queue;
+}
+
+void
+sockmux_sender_reset (SockMuxSender *sender)
+{
+  g_return_if_fail(SOCKMUX_IS_SENDER(sender));
+
+  /* abort a write that is still in flight for the dropped entries */
+  g_cancellable_cancel(sender->output_cancellable);
+  g_object_unref(sender->output_cancellable);
+  sender->output_cancellable = g_cancellable_new();
+
+  sockmux_sender_flush_queue(sender);
+
+  g_mutex_lock(&sender->mutex);
+  if (sender->delay_source)
+    {
+      g_source_destroy(sender->delay_source);
+      sender->delay_source = NULL;
+    }
+  sender->delay_expired = FALSE;
+  g_mutex_unlock(&sender->mutex);
+
+  g_output_stream_flush(sender->output, NULL, NULL);
+  g_output_stream_clear_pending(sender->output);
+}
+
+static void
+sockmux_sender_init (SockMuxSender *sender)
+{
+  sender->output_cancellable = g_cancellable_new();
+  g_mutex_init(&sender->mutex);
+  g_cond_init(&sender->sync_cond);
+  sender->protocol_version = PROTOCOL_VERSION;
+  g_mutex_init(&sender->compress_mutex);
+  sender->compression_threshold = DEFAULT_COMPRESSION_THRESHOLD;
+  sender->channels = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                           (GDestroyNotify) sockmux_channel_free);
+  sender->id_stats = sockmux_stats_ids_new();
+  sender->max_chunk_size = DEFAULT_MAX_CHUNK_SIZE;
+  sender->flush_policy = SOCKMUX_SENDER_FLUSH_AUTO;
+  sender->flush_bytes = DEFAULT_MAX_CHUNK_SIZE;
+  sender->output_fd = -1;
+}
+
+SockMuxSender *sockmux_sender_new (GOutputStream *stream,
+                                   guint magic)
+{
+  return sockmux_sender_new_full(stream, magic, PROTOCOL_VERSION);
+}
+
+static SockMuxSender *
+sockmux_sender_create (GOutputStream *stream,
+                       guint          magic,
+                       guint          protocol_version,
+                       gboolean       threaded,
+                       gboolean       blocking)
+{
+  SockMuxSender *sender;
+  SockMuxAsync *async;
+
+  g_return_val_if_fail(protocol_version >= 1 &&
+                       protocol_version <= MAX_PROTOCOL_VERSION, NULL);
+
+  sender = g_object_new(SOCKMUX_TYPE_SENDER, NULL);
+  sender->output = stream;
+  sender->magic = magic;
+  sender->protocol_version = protocol_version;
+  sender->blocking = blocking;
+
+  if (threaded)
+    {
+      sender->context = g_main_context_new();
+      sender->thread_loop = g_main_loop_new(sender->context, FALSE);
+
+      /* no reference, the thread is stopped before the sender goes away */
+      sender->inbox_source = g_source_new(&inbox_source_funcs, sizeof(GSource));
+      g_source_set_callback(sender->inbox_source, inbox_cb, sender, NULL);
+      g_source_attach(sender->inbox_source, sender->context);
+
+      sender->thread = g_thread_new("sockmux-sender", sockmux_sender_thread,
+                                    g_main_loop_ref(sender->thread_loop));
+    }
+
+  if (G_IS_FILE_DESCRIPTOR_BASED(stream))
+    sender->output_fd = g_file_descriptor_based_get_fd(G_FILE_DESCRIPTOR_BASED(stream));
+
+  /*
+   * Messages can be written synchronously if the stream supports
+   * non-blocking writes and does not need to be flushed.
+   */
+  sender->fast_path = G_IS_POLLABLE_OUTPUT_STREAM(stream) &&
+                      g_pollable_output_stream_can_poll(G_POLLABLE_OUTPUT_STREAM(stream)) &&
+                      !G_IS_FILTER_OUTPUT_STREAM(stream);
+
+  /* send protocol handshake, announcing what our receiver can decode */
+  if (sender->protocol_version < 2)
+    {
+      SockMuxHandshake hs;
+
+      hs.magic = GUINT_TO_BE(sender->magic);
+      hs.protocol_version = GUINT_TO_BE(sender->protocol_version);
+      async = sockmux_async_new(sender, (gconstpointer) &hs, sizeof(hs));
+    }
+  else
+    {
+      SockMuxHandshake2 hs;
+
+      hs.magic = GUINT_TO_BE(sender->magic);
+      hs.protocol_version = GUINT_TO_BE(sender->protocol_version);
+      hs.capabilities = GUINT_TO_BE(SOCKMUX_CAPABILITY_ZLIB);
+      async = sockmux_async_new(sender, (gconstpointer) &hs, sizeof(hs));
+    }
+
+  sockmux_sender_push(sender, async);
+
+  return sender;
+}
+
+SockMuxSender *sockmux_sender_new_full (GOutputStream *stream,
+                                        guint magic,
+                                        guint protocol_version)
+{
+  return sockmux_sender_create(stream, magic, protocol_version, FALSE, FALSE);
+}
+
+SockMuxSender *sockmux_sender_new_threaded (GOutputStream *stream,
+                                            guint magic,
+                                            guint protocol_version)
+{
+  return sockmux_sender_create(stream, magic, protocol_version, TRUE, FALSE);
+}
+
+SockMuxSender *sockmux_sender_new_blocking (GOutputStream *stream,
+                                            guint magic,
+                                            guint protocol_version)
+{
+  return sockmux_sender_create(stream, magic, protocol_version, FALSE, TRUE);
+}
+
+GMainContext *
+sockmux_sender_get_context (SockMuxSender *sender)
+{
+  g_return_val_if_fail(SOCKMUX_IS_SENDER(sender), NULL);
+
+  return sender->context;
+}
+
+static void
+sockmux_sender_finalize (GObject *object)
+{
+  SockMuxSender *sender = SOCKMUX_SENDER(object);
+
+  sockmux_sender_flush_queue(sender);
+  g_hash_table_destroy(sender->channels);
+  sockmux_stats_ids_free(sender->id_stats);
+
+  if (sender->thread)
+    {
+      /* the loop might not be running yet, so quit it from within */
+      g_main_context_invoke(sender->context, sockmux_sender_thread_quit,
+                            sender->thread_loop);
+
+      /* the last reference may have been dropped by the I/O thread itself */
+      if (sender->thread != g_thread_self())
+        g_thread_join(sender->thread);
+      else
+        g_thread_unref(sender->thread);
+
+      sender->thread = NULL;
+
+      g_source_destroy(sender->inbox_source);
+      g_source_unref(sender->inbox_source);
+      g_main_loop_unref(sender->thread_loop);
+      g_main_context_unref(sender->context);
+    }
+
+  if (sender->output_cancellable)
+    {
+      g_object_unref(sender->output_cancellable);
+      sender->output_cancellable = NULL;
+    }
+
+  g_free(sender->body_buffer);
+  sender->body_buffer = NULL;
+
+  if (sender->compressor)
+    {
+      g_object_unref(sender->compressor);
+      sender->compressor = NULL;
+    }
+
+  g_mutex_clear(&sender->compress_mutex);
+  g_cond_clear(&sender->sync_cond);
+
+  g_mutex_clear(&sender->mutex);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+sockmux_sender_class_init (SockMuxSenderClass *klass)
+{
+  GObjectClass *object_class;
+  GParamSpec *pspec;
+
+  parent_class = (GObjectClass *) g_type_class_peek_parent (klass);
+  object_class = (GObjectClass *) klass;
+
+  object_class->get_property = sockmux_sender_get_property;
+  object_class->set_property = sockmux_sender_set_property;
+  object_class->finalize = sockmux_sender_finalize;
+
+  pspec = g_param_spec_int(SOCKMUX_SENDER_PROP_MAX_OUTPUT_QUEUE,
+                           "The maximum length of the output queue",
+                           "Get the number",
+                           0, G_MAXINT, 0,
+                           G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_MAX_OUTPUT_QUEUE, pspec);
+
+  pspec = g_param_spec_int(SOCKMUX_SENDER_PROP_MAX_CHUNK_SIZE,
+                           "The maximum size of a single data block to queue",
+                           "Get the number",
+                           0, G_MAXINT, DEFAULT_MAX_CHUNK_SIZE,
+                           G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_MAX_CHUNK_SIZE, pspec);
+
+  pspec = g_param_spec_int(SOCKMUX_SENDER_PROP_MAX_DELAY,
+                           "The time in ms to hold back writes smaller than a chunk",
+                           "Get the number",
+                           0, G_MAXINT, 0,
+                           G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_MAX_DELAY, pspec);
+
+  pspec = g_param_spec_int(SOCKMUX_SENDER_PROP_FLUSH_POLICY,
+                           "When to flush the output stream (SockMuxSenderFlushPolicy)",
+                           "Get the number",
+                           SOCKMUX_SENDER_FLUSH_AUTO, SOCKMUX_SENDER_FLUSH_BYTES,
+                           SOCKMUX_SENDER_FLUSH_AUTO,
+                           G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_FLUSH_POLICY, pspec);
+
+  pspec = g_param_spec_int(SOCKMUX_SENDER_PROP_FLUSH_BYTES,
+                           "The number of bytes between flushes for SOCKMUX_SENDER_FLUSH_BYTES",
+                           "Get the number",
+                           1, G_MAXINT, DEFAULT_MAX_CHUNK_SIZE,
+                           G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_FLUSH_BYTES, pspec);
+
+  pspec = g_param_spec_int(SOCKMUX_SENDER_PROP_COMPRESSION,
+                           "The payload compression to use (SockMuxSenderCompression)",
+                           "Get the number",
+                           SOCKMUX_SENDER_COMPRESSION_NONE, SOCKMUX_SENDER_COMPRESSION_ZLIB,
+                           SOCKMUX_SENDER_COMPRESSION_NONE,
+                           G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_COMPRESSION, pspec);
+
+  pspec = g_param_spec_int(SOCKMUX_SENDER_PROP_COMPRESSION_THRESHOLD,
+                           "The minimum payload size to compress",
+                           "Get the number",
+                           0, G_MAXINT, DEFAULT_COMPRESSION_THRESHOLD,
+                           G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_COMPRESSION_THRESHOLD, pspec);
+
+  pspec = g_param_spec_int(SOCKMUX_SENDER_PROP_HIGH_WATERMARK,
+                           "The queue size in bytes at which queue-full is emitted, 0 to disable",
+                           "Get the number",
+                           0, G_MAXINT, 0,
+                           G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_HIGH_WATERMARK, pspec);
+
+  pspec = g_param_spec_int(SOCKMUX_SENDER_PROP_LOW_WATERMARK,
+                           "The queue size in bytes at which writable is emitted after queue-full",
+                           "Get the number",
+                           0, G_MAXINT, 0,
+                           G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_LOW_WATERMARK, pspec);
+
+  pspec = g_param_spec_uint64(SOCKMUX_SENDER_PROP_MESSAGES_SENT,
+                              "The number of messages completely written",
+                              "Get the number",
+                              0, G_MAXUINT64, 0,
+                              G_PARAM_READABLE);
+  g_object_class_install_property (object_class, PROP_MESSAGES_SENT, pspec);
+
+  pspec = g_param_spec_uint64(SOCKMUX_SENDER_PROP_BYTES_WRITTEN,
+                              "The number of bytes written to the stream",
+                              "Get the number",
+                              0, G_MAXUINT64, 0,
+                              G_PARAM_READABLE);
+  g_object_class_install_property (object_class, PROP_BYTES_WRITTEN, pspec);
+
+  signals[SIGNAL_WRITE_ERROR] =
+    g_signal_new ("write-error",
+                  G_OBJECT_CLASS_TYPE (klass),
+                  G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+                  0,
+                  NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
 
   signals[SIGNAL_STREAM_OVERFLOW] =
     g_signal_new ("stream-overflow",
@@ -401,6 +2791,20 @@ sockmux_sender_class_init (SockMuxSenderClass *klass)
                   G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
                   0,
                   NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+
+  signals[SIGNAL_QUEUE_FULL] =
+    g_signal_new ("queue-full",
+                  G_OBJECT_CLASS_TYPE (klass),
+                  G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+                  0,
+                  NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+
+  signals[SIGNAL_WRITABLE] =
+    g_signal_new ("writable",
+                  G_OBJECT_CLASS_TYPE (klass),
+                  G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+                  0,
+                  NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
 }
 
 G_DEFINE_TYPE (SockMuxSender, sockmux_sender, G_TYPE_OBJECT)
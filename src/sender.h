@@ -23,11 +23,64 @@
 #define _LIBSOCKMUX_GLIB_SENDER_H_
 
 #include <glib-object.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
-#define SOCKMUX_SENDER_PROP_MAX_OUTPUT_QUEUE "max-output-queue"
-#define SOCKMUX_SENDER_PROP_MAX_CHUNK_SIZE   "max-chunk-size"
+#define SOCKMUX_SENDER_PROP_MAX_OUTPUT_QUEUE      "max-output-queue"
+#define SOCKMUX_SENDER_PROP_MAX_CHUNK_SIZE        "max-chunk-size"
+#define SOCKMUX_SENDER_PROP_MAX_DELAY             "max-delay"
+#define SOCKMUX_SENDER_PROP_FLUSH_POLICY          "flush-policy"
+#define SOCKMUX_SENDER_PROP_FLUSH_BYTES           "flush-bytes"
+#define SOCKMUX_SENDER_PROP_COMPRESSION           "compression"
+#define SOCKMUX_SENDER_PROP_COMPRESSION_THRESHOLD "compression-threshold"
+#define SOCKMUX_SENDER_PROP_HIGH_WATERMARK        "high-watermark"
+#define SOCKMUX_SENDER_PROP_LOW_WATERMARK         "low-watermark"
+#define SOCKMUX_SENDER_PROP_MESSAGES_SENT         "messages-sent"
+#define SOCKMUX_SENDER_PROP_BYTES_WRITTEN         "bytes-written"
+
+/*
+ * Controls when the output stream is flushed. AUTO flushes after each
+ * completed message for filter streams such as GBufferedOutputStream,
+ * and never for streams that write straight to a file descriptor.
+ * BYTES flushes every "flush-bytes" bytes and when the queue drains.
+ */
+typedef enum {
+  SOCKMUX_SENDER_FLUSH_AUTO,
+  SOCKMUX_SENDER_FLUSH_NEVER,
+  SOCKMUX_SENDER_FLUSH_MESSAGE,
+  SOCKMUX_SENDER_FLUSH_DRAIN,
+  SOCKMUX_SENDER_FLUSH_BYTES,
+} SockMuxSenderFlushPolicy;
+
+/*
+ * Message priorities, most urgent first. Queued messages are written
+ * in order of priority. With protocol version 2, large messages are
+ * also split into frames, so urgent messages can be sent in between.
+ */
+typedef enum {
+  SOCKMUX_SENDER_PRIORITY_HIGH,
+  SOCKMUX_SENDER_PRIORITY_DEFAULT,
+  SOCKMUX_SENDER_PRIORITY_LOW,
+  SOCKMUX_SENDER_PRIORITY_BULK,
+} SockMuxSenderPriority;
+
+#define SOCKMUX_SENDER_N_PRIORITIES 4
+
+/*
+ * Payload compression. Messages of at least "compression-threshold"
+ * bytes are compressed if the peer announced it can decode them, and
+ * are sent as they are if that doesn't make them any smaller.
+ */
+typedef enum {
+  SOCKMUX_SENDER_COMPRESSION_NONE,
+  SOCKMUX_SENDER_COMPRESSION_ZLIB,
+} SockMuxSenderCompression;
+
+/* announced in the handshake of protocol version 2 */
+typedef enum {
+  SOCKMUX_CAPABILITY_ZLIB = 1 << 0,
+} SockMuxCapabilities;
 
 typedef struct _SockMuxSender      SockMuxSender;
 typedef struct _SockMuxSenderClass SockMuxSenderClass;
@@ -38,6 +91,8 @@ struct _SockMuxSenderClass {
   /* signals */
   void (* stream_end) (void);
   void (* stream_overflow) (void);
+  void (* queue_full) (void);
+  void (* writable) (void);
 };
 
 void sockmux_sender_send (SockMuxSender  *sender,
@@ -45,9 +100,177 @@ void sockmux_sender_send (SockMuxSender  *sender,
                           gconstpointer   data,
                           gsize           size);
 
+void sockmux_sender_send_priority (SockMuxSender  *sender,
+                                   guint           message_id,
+                                   guint           priority,
+                                   gconstpointer   data,
+                                   gsize           size);
+
+/*
+ * Like sockmux_sender_send(), but without copying the payload. A
+ * reference to @bytes is held until the message has been written out.
+ */
+void sockmux_sender_send_bytes (SockMuxSender  *sender,
+                                guint           message_id,
+                                GBytes         *bytes);
+
+void sockmux_sender_send_bytes_priority (SockMuxSender  *sender,
+                                         guint           message_id,
+                                         guint           priority,
+                                         GBytes         *bytes);
+
+/*
+ * Like sockmux_sender_send(), but takes ownership of @data, which must
+ * have been allocated with g_malloc(). It is freed once written out, or
+ * right away if the message is dropped.
+ */
+void sockmux_sender_send_take (SockMuxSender  *sender,
+                               guint           message_id,
+                               gpointer        data,
+                               gsize           size);
+
+/*
+ * Queues a message and completes once it has been written to the
+ * output stream, or with G_IO_ERROR_CANCELLED if it was dropped by
+ * sockmux_sender_reset(). @data is not copied and must stay valid
+ * until then. Unlike the other send functions, this never drops the
+ * message because the queue is longer than "max-output-queue".
+ * @cancellable is only checked before the message is queued.
+ *
+ * To keep the queue in bounds instead, set "high-watermark": the
+ * sender emits "queue-full" once that many bytes are queued, and
+ * "writable" when the queue has drained to "low-watermark" again.
+ * "low-watermark" is lowered to one byte below "high-watermark" if it
+ * is set higher.
+ */
+void sockmux_sender_send_async (SockMuxSender       *sender,
+                                guint                message_id,
+                                gconstpointer        data,
+                                gsize                size,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data);
+
+gboolean sockmux_sender_send_finish (SockMuxSender  *sender,
+                                     GAsyncResult   *result,
+                                     GError        **error);
+
+/*
+ * For senders made with sockmux_sender_new_blocking(): writes whatever
+ * is queued and then the message with blocking calls on the calling
+ * thread, and returns once it is out. Messages with a flow controlled
+ * ID fail with G_IO_ERROR_WOULD_BLOCK if there is no credit left. After
+ * any other error, the stream should be considered broken.
+ */
+gboolean sockmux_sender_send_sync (SockMuxSender  *sender,
+                                   guint           message_id,
+                                   gconstpointer   data,
+                                   gsize           size,
+                                   GCancellable   *cancellable,
+                                   GError        **error);
+
+/*
+ * Send a message whose @length bytes of payload are read from @source
+ * (or @fd, starting at @offset) in max-chunk-size pieces while the
+ * message is written out, so the body never has to be held in memory.
+ * If both the source and the output stream are backed by file
+ * descriptors, the data is moved with sendfile() or splice().
+ * @fd is duplicated and may be closed by the caller right away. An
+ * @offset of -1 reads from the current position of @fd, for pipes,
+ * sockets and other descriptors that can't seek.
+ *
+ * If the source fails or ends before @length bytes, the peer is left
+ * waiting for the rest of the body. The sender emits "write-error",
+ * drops its queue and refuses all further messages then.
+ */
+void sockmux_sender_send_stream (SockMuxSender  *sender,
+                                 guint           message_id,
+                                 GInputStream   *source,
+                                 gsize           length);
+
+void sockmux_sender_send_fd (SockMuxSender  *sender,
+                             guint           message_id,
+                             gint            fd,
+                             goffset         offset,
+                             gsize           length);
+
 #define sockmux_sender_send_msg(S,MESSAGEID) \
         sockmux_sender_send(S,MESSAGEID,NULL,0)
 
+/*
+ * While corked, messages are only queued, and written out once a full
+ * max-chunk-size worth of data is pending. Calls nest; the last uncork
+ * writes out everything that is left.
+ */
+void sockmux_sender_cork   (SockMuxSender *sender);
+void sockmux_sender_uncork (SockMuxSender *sender);
+
+/* number of bytes and messages not yet written to the stream */
+gsize sockmux_sender_get_queue_size   (SockMuxSender *sender);
+guint sockmux_sender_get_queue_length (SockMuxSender *sender);
+
+/*
+ * Histogram bucket i counts values from 2^i to 2^(i+1) - 1. The first
+ * bucket also counts 0, and the last one everything that is larger.
+ */
+#define SOCKMUX_STATS_BUCKETS 24
+
+/* the number of message IDs counted separately in "message-ids" */
+#define SOCKMUX_STATS_MAX_IDS 256
+
+typedef struct {
+  guint64 messages_sent;
+  guint64 bytes_sent;        /* payload of the messages sent */
+  guint64 bytes_written;     /* including headers and control frames */
+  guint64 write_calls;
+  guint64 partial_writes;    /* asynchronous writes that came back short */
+  guint64 fast_path_writes;  /* messages written without queueing first */
+  guint64 messages_dropped;  /* on overflow, or by sockmux_sender_reset() */
+  guint   queue_length;
+  gsize   queue_size;
+  gsize   queue_size_peak;
+  guint64 size_histogram[SOCKMUX_STATS_BUCKETS];     /* payload bytes */
+  guint64 latency_histogram[SOCKMUX_STATS_BUCKETS];  /* usecs until written */
+} SockMuxSenderStats;
+
+/*
+ * Fills @stats with a snapshot of the counters since the sender was
+ * created. The variant version returns the same as a floating a{sv},
+ * plus "message-ids", which maps each message ID to the number of
+ * messages and payload bytes sent with it (a{u(tt)}). Only the first
+ * SOCKMUX_STATS_MAX_IDS IDs seen get an entry, "other-message-ids" ((tt))
+ * sums up the messages with any other ID.
+ */
+void      sockmux_sender_get_stats         (SockMuxSender      *sender,
+                                            SockMuxSenderStats *stats);
+GVariant *sockmux_sender_get_stats_variant (SockMuxSender      *sender);
+
+/*
+ * Per-channel flow control, where a channel is a message ID. Once the
+ * peer has granted credit for a message ID, messages with that ID are
+ * only written while there is credit for all of their payload, and wait
+ * in the queue otherwise, without holding back other channels. A message
+ * larger than the whole window is written once all credit has come back,
+ * so it is the only one in flight. Credit is normally granted by
+ * a receiver linked with sockmux_receiver_set_sender(), which calls
+ * sockmux_sender_add_credit() for credit it receives, and
+ * sockmux_sender_send_credit() to grant credit to the peer. Sending
+ * credit needs protocol version 2 on both ends.
+ */
+void sockmux_sender_add_credit  (SockMuxSender *sender,
+                                 guint message_id,
+                                 guint credit);
+void sockmux_sender_send_credit (SockMuxSender *sender,
+                                 guint message_id,
+                                 guint credit);
+
+/*
+ * Tells the sender what the peer can decode. Called by a linked
+ * receiver once the peer's handshake has arrived.
+ */
+void sockmux_sender_set_peer_capabilities (SockMuxSender *sender,
+                                           guint capabilities);
+
 void sockmux_sender_set_max_output_queue (SockMuxSender *sender,
                                           guint max_output_queue);
 
@@ -56,6 +279,40 @@ void sockmux_sender_reset (SockMuxSender *sender);
 SockMuxSender *sockmux_sender_new(GOutputStream *stream,
                                   guint magic);
 
+/*
+ * Protocol version 2 fragments large messages so that messages of a
+ * higher priority are not stuck behind them. The receiver must be from
+ * libsockmux-glib 1.2 or later; sockmux_sender_new() uses version 1.
+ */
+SockMuxSender *sockmux_sender_new_full(GOutputStream *stream,
+                                       guint magic,
+                                       guint protocol_version);
+
+/*
+ * Like sockmux_sender_new_full(), but all I/O is done by a thread of
+ * the sender's own, with its own main context. Messages can be sent
+ * from any thread without waiting for a lock or the caller's main
+ * loop; they are written in the order in which they were sent. Pass
+ * the context to sockmux_receiver_new_full() to have the receiver for
+ * the same peer served by that thread, too.
+ */
+SockMuxSender *sockmux_sender_new_threaded(GOutputStream *stream,
+                                           guint magic,
+                                           guint protocol_version);
+
+/* the context of the I/O thread, or NULL for a sender without one */
+GMainContext *sockmux_sender_get_context (SockMuxSender *sender);
+
+/*
+ * A sender that never writes from a main loop, for threads that do
+ * their own I/O. sockmux_sender_send() and friends still write right
+ * away if the stream can take it without blocking, and queue otherwise;
+ * sockmux_sender_send_sync() writes the queue out.
+ */
+SockMuxSender *sockmux_sender_new_blocking(GOutputStream *stream,
+                                           guint magic,
+                                           guint protocol_version);
+
 GType sockmux_sender_get_type (void);
 #define SOCKMUX_TYPE_SENDER             sockmux_sender_get_type()
 #define SOCKMUX_SENDER(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj), SOCKMUX_TYPE_SENDER, SockMuxSender))
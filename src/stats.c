@@ -0,0 +1,105 @@
+/*
+ * libsockmux - A socket muxer library
+ *
+ *   Copyright (C) 2011 Daniel Mack <sockmux@zonque.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA.
+ */
+
+#include <glib.h>
+
+#include "sender.h"
+#include "stats.h"
+
+SockMuxIdTable *
+sockmux_stats_ids_new (void)
+{
+  SockMuxIdTable *table = g_new0(SockMuxIdTable, 1);
+
+  table->ids = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+  return table;
+}
+
+void
+sockmux_stats_ids_free (SockMuxIdTable *table)
+{
+  g_hash_table_destroy(table->ids);
+  g_free(table);
+}
+
+void
+sockmux_stats_count_id (SockMuxIdTable *table,
+                        guint           message_id,
+                        gsize           size)
+{
+  SockMuxIdStats *id_stats;
+
+  id_stats = g_hash_table_lookup(table->ids, GUINT_TO_POINTER(message_id));
+  if (id_stats == NULL)
+    {
+      if (g_hash_table_size(table->ids) < SOCKMUX_STATS_MAX_IDS)
+        {
+          id_stats = g_new0(SockMuxIdStats, 1);
+          g_hash_table_insert(table->ids, GUINT_TO_POINTER(message_id), id_stats);
+        }
+      else
+        id_stats = &table->other;
+    }
+
+  id_stats->messages++;
+  id_stats->bytes += size;
+}
+
+void
+sockmux_stats_histogram_add (guint64 *histogram,
+                             guint64  value)
+{
+  guint bucket = g_bit_storage(value) - 1;
+
+  histogram[MIN(bucket, SOCKMUX_STATS_BUCKETS - 1)]++;
+}
+
+GVariant *
+sockmux_stats_ids_variant (SockMuxIdTable *table)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  SockMuxIdStats *id_stats;
+  gpointer key;
+
+  g_variant_builder_init(&builder, G_VARIANT_TYPE("a{u(tt)}"));
+
+  g_hash_table_iter_init(&iter, table->ids);
+  while (g_hash_table_iter_next(&iter, &key, (gpointer *) &id_stats))
+    g_variant_builder_add(&builder, "{u(tt)}", GPOINTER_TO_UINT(key),
+                          id_stats->messages, id_stats->bytes);
+
+  return g_variant_builder_end(&builder);
+}
+
+GVariant *
+sockmux_stats_other_variant (SockMuxIdTable *table)
+{
+  return g_variant_new("(tt)", table->other.messages, table->other.bytes);
+}
+
+GVariant *
+sockmux_stats_histogram_variant (const guint64 *histogram)
+{
+  return g_variant_new_fixed_array(G_VARIANT_TYPE_UINT64, histogram,
+                                   SOCKMUX_STATS_BUCKETS, sizeof(guint64));
+}
@@ -0,0 +1,62 @@
+/*
+ * libsockmux - A socket muxer library
+ *
+ *   Copyright (C) 2011 Daniel Mack <sockmux@zonque.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA.
+ */
+
+#ifndef _LIBSOCKMUX_GLIB_STATS_H_
+#define _LIBSOCKMUX_GLIB_STATS_H_
+
+#include <glib.h>
+
+/* what senders and receivers count per message ID */
+typedef struct {
+  guint64 messages;
+  guint64 bytes;
+} SockMuxIdStats;
+
+/*
+ * Message IDs are counted one by one up to SOCKMUX_STATS_MAX_IDS
+ * different ones, so a peer cannot make the table grow without bounds.
+ * Any further IDs are summed up in @other.
+ */
+typedef struct {
+  GHashTable     *ids;
+  SockMuxIdStats  other;
+} SockMuxIdTable;
+
+SockMuxIdTable *sockmux_stats_ids_new (void);
+void sockmux_stats_ids_free (SockMuxIdTable *table);
+
+void sockmux_stats_count_id (SockMuxIdTable *table,
+                             guint           message_id,
+                             gsize           size);
+
+void sockmux_stats_histogram_add (guint64 *histogram,
+                                  guint64  value);
+
+/* a{u(tt)}, message ID to number of messages and bytes */
+GVariant *sockmux_stats_ids_variant (SockMuxIdTable *table);
+
+/* (tt), the same for all IDs beyond SOCKMUX_STATS_MAX_IDS */
+GVariant *sockmux_stats_other_variant (SockMuxIdTable *table);
+
+/* at, one entry per bucket */
+GVariant *sockmux_stats_histogram_variant (const guint64 *histogram);
+
+#endif /* _LIBSOCKMUX_GLIB_STATS_H_ */
@@ -0,0 +1,44 @@
+/*
+ * libsockmux - A socket muxer library
+ *
+ *   Copyright (C) 2011 Daniel Mack <sockmux@zonque.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA.
+ */
+
+#ifndef _LIBSOCKMUX_GLIB_TRACE_H_
+#define _LIBSOCKMUX_GLIB_TRACE_H_
+
+/*
+ * Static tracepoints for perf and bpftrace, in the "sockmux" provider,
+ * if configured with --enable-sdt. Otherwise they compile to nothing,
+ * and their arguments are not evaluated.
+ */
+#ifdef ENABLE_SDT
+#include <sys/sdt.h>
+
+#define SOCKMUX_TRACE1(name, a)          DTRACE_PROBE1(sockmux, name, a)
+#define SOCKMUX_TRACE2(name, a, b)       DTRACE_PROBE2(sockmux, name, a, b)
+#define SOCKMUX_TRACE3(name, a, b, c)    DTRACE_PROBE3(sockmux, name, a, b, c)
+#define SOCKMUX_TRACE4(name, a, b, c, d) DTRACE_PROBE4(sockmux, name, a, b, c, d)
+#else
+#define SOCKMUX_TRACE1(name, a)          do { } while (0)
+#define SOCKMUX_TRACE2(name, a, b)       do { } while (0)
+#define SOCKMUX_TRACE3(name, a, b, c)    do { } while (0)
+#define SOCKMUX_TRACE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif /* _LIBSOCKMUX_GLIB_TRACE_H_ */
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <glib.h>
@@ -36,10 +37,12 @@
 #define N_TESTS 10000
 
 static GMainLoop *loop;
+static guint protocol_version;
 static guint step = 0;
 static SockMuxSender *sender = NULL;
 static SockMuxReceiver *receiver = NULL;
 static GChecksum *checksum;
+static gulong handler_id;
 
 static void trigger(void);
 
@@ -88,6 +91,7 @@ static void receiver_cb (SockMuxReceiver *rec,
     }
 
   g_checksum_free(checksum2);
+  sockmux_receiver_disconnect(rec, handler_id);
   trigger();
 }
 
@@ -107,10 +111,26 @@ static void trigger(void)
       g_checksum_reset(checksum);
       g_checksum_update(checksum, data, size);
 
-      sockmux_receiver_connect_filtered(receiver, step, receiver_cb, receiver);
-      sockmux_sender_send(sender, step, data, size);
+      handler_id = sockmux_receiver_connect_filtered(receiver, step,
+                                                     receiver_cb, receiver);
 
-      g_free(data);
+      /* the copying and the taking send function, in turns */
+      if (protocol_version < 2 && step % 2)
+        {
+          sockmux_sender_send(sender, step, data, size);
+          g_free(data);
+        }
+      else if (protocol_version < 2)
+        sockmux_sender_send_take(sender, step, data, size);
+      else
+        {
+          GBytes *bytes = g_bytes_new_take(data, size);
+
+          sockmux_sender_send_bytes_priority(sender, step,
+                                             step % SOCKMUX_SENDER_N_PRIORITIES,
+                                             bytes);
+          g_bytes_unref(bytes);
+        }
     }
   else
     quit();
@@ -122,13 +142,18 @@ static void receiver_protocol_error(SockMuxReceiver *receiver,
   g_critical("protocol error!");
 }
 
-int main(int argc, char *argv[])
+static void receiver_stream_end(SockMuxReceiver *receiver,
+                                gpointer userdata)
+{
+  g_main_loop_quit(loop);
+}
+
+static void run(guint version)
 {
   gint ret, fds[2];
   GInputStream *input;
   GOutputStream *output;
 
-  g_type_init();
   ret = pipe(fds);
 
   if (ret < 0)
@@ -147,7 +172,7 @@ int main(int argc, char *argv[])
 		  exit(EXIT_FAILURE);
     }
 
-  sender = sockmux_sender_new(output, SOCKMUX_PROTOCOL_MAGIC);
+  sender = sockmux_sender_new_full(output, SOCKMUX_PROTOCOL_MAGIC, version);
   if (sender == NULL)
     {
       g_error("sockmux_sender_new() failed");
@@ -156,11 +181,777 @@ int main(int argc, char *argv[])
 
   g_signal_connect(receiver, "protocol-error",
                    G_CALLBACK(receiver_protocol_error), NULL);
+  g_signal_connect(receiver, "stream-end",
+                   G_CALLBACK(receiver_stream_end), NULL);
 
-  loop = g_main_loop_new(NULL, FALSE);
+  protocol_version = version;
+  step = 0;
   checksum = g_checksum_new(G_CHECKSUM_SHA1);
   trigger();
   g_main_loop_run(loop);
 
+  /* let the receiver's read finish before it goes away */
+  g_output_stream_close(output, NULL, NULL);
+  g_main_loop_run(loop);
+
+  g_object_unref(receiver);
+  g_object_unref(input);
+  g_object_unref(output);
+}
+
+/*
+ * Flow control: messages on a manual window only arrive as far as the
+ * window reaches, and as the application consumes them.
+ */
+#define WINDOW_ID      0x100
+#define WINDOW_SIZE    (64 * 1024)
+#define WINDOW_MSG     (24 * 1024)
+
+static gsize window_received;
+static guint streams_ended;
+
+static void window_cb (SockMuxReceiver *rec,
+                       guint message_id,
+                       const guint8 *data,
+                       guint size,
+                       gpointer userdata)
+{
+  window_received += size;
+}
+
+static void window_stream_end(SockMuxReceiver *rec,
+                              gpointer userdata)
+{
+  streams_ended++;
+}
+
+static gboolean timed_out_cb(gpointer data)
+{
+  *(gboolean *) data = TRUE;
+  return FALSE;
+}
+
+/* iterates until *@value reaches @expected, or 200 ms without that */
+static void wait_for(gsize *value, gsize expected)
+{
+  gboolean timed_out = FALSE;
+  guint id = g_timeout_add(200, timed_out_cb, &timed_out);
+
+  while (!timed_out && *value < expected)
+    g_main_context_iteration(NULL, TRUE);
+
+  if (!timed_out)
+    g_source_remove(id);
+}
+
+static void check_received(gsize expected)
+{
+  /* anything beyond it would have to arrive in the meantime */
+  wait_for(&window_received, G_MAXSIZE);
+
+  if (window_received != expected)
+    {
+      g_error("window: received %" G_GSIZE_FORMAT " bytes, expected %" G_GSIZE_FORMAT,
+              window_received, expected);
+      exit(EXIT_FAILURE);
+    }
+}
+
+static void send_window_msgs(SockMuxSender *snd, guint n, gsize size)
+{
+  guint i;
+
+  for (i = 0; i < n; i++)
+    {
+      guint8 *data = g_malloc0(size);
+      sockmux_sender_send_take(snd, WINDOW_ID, data, size);
+    }
+}
+
+static void run_window(void)
+{
+  GInputStream *input[2];
+  GOutputStream *output[2];
+  SockMuxSender *snd[2];
+  SockMuxReceiver *rec[2];
+  gsize expected;
+  gint i, fds[2];
+
+  /* messages go from snd[0] to rec[0], credit from snd[1] to rec[1] */
+  for (i = 0; i < 2; i++)
+    {
+      if (pipe(fds) < 0)
+        {
+          g_error("pipe() failed");
+          exit(EXIT_FAILURE);
+        }
+
+      input[i] = g_unix_input_stream_new(fds[0], TRUE);
+      output[i] = g_unix_output_stream_new(fds[1], TRUE);
+      rec[i] = sockmux_receiver_new(input[i], SOCKMUX_PROTOCOL_MAGIC);
+      snd[i] = sockmux_sender_new_full(output[i], SOCKMUX_PROTOCOL_MAGIC, 2);
+
+      g_signal_connect(rec[i], "protocol-error",
+                       G_CALLBACK(receiver_protocol_error), NULL);
+      g_signal_connect(rec[i], "stream-end",
+                       G_CALLBACK(window_stream_end), NULL);
+    }
+
+  sockmux_receiver_set_sender(rec[0], snd[1]);
+  sockmux_receiver_set_sender(rec[1], snd[0]);
+  sockmux_receiver_connect_filtered(rec[0], WINDOW_ID, window_cb, NULL);
+  window_received = 0;
+  streams_ended = 0;
+
+  /* sent before the peer knows the window, so they are not charged */
+  send_window_msgs(snd[0], 4, WINDOW_MSG);
+  sockmux_receiver_set_window(rec[0], WINDOW_ID, WINDOW_SIZE, TRUE);
+  expected = 4 * WINDOW_MSG;
+  check_received(expected);
+
+  /* and give no credit back */
+  sockmux_receiver_consume(rec[0], WINDOW_ID, expected);
+
+  /* only as many as fit into the window completely */
+  send_window_msgs(snd[0], 4, WINDOW_MSG);
+  expected += 2 * WINDOW_MSG;
+  check_received(expected);
+
+  sockmux_receiver_consume(rec[0], WINDOW_ID, 2 * WINDOW_MSG);
+  expected += 2 * WINDOW_MSG;
+  check_received(expected);
+
+  /* a message larger than the window goes once all credit is back, alone */
+  sockmux_receiver_consume(rec[0], WINDOW_ID, 2 * WINDOW_MSG);
+  send_window_msgs(snd[0], 1, 2 * WINDOW_SIZE);
+  send_window_msgs(snd[0], 1, 1024);
+  expected += 2 * WINDOW_SIZE;
+  check_received(expected);
+
+  sockmux_receiver_consume(rec[0], WINDOW_ID, 2 * WINDOW_SIZE);
+  expected += 1024;
+  check_received(expected);
+
+  for (i = 0; i < 2; i++)
+    {
+      sockmux_sender_reset(snd[i]);
+      g_object_unref(snd[i]);
+      g_output_stream_close(output[i], NULL, NULL);
+    }
+
+  while (streams_ended < 2)
+    g_main_context_iteration(NULL, TRUE);
+
+  for (i = 0; i < 2; i++)
+    {
+      g_object_unref(rec[i]);
+      g_object_unref(input[i]);
+      g_object_unref(output[i]);
+    }
+}
+
+/*
+ * A threaded sender fed by several producer threads, and a receiver
+ * served by the sender's I/O thread. The messages of each producer have
+ * to arrive in order, and both objects are finally released from
+ * within the I/O thread.
+ */
+#define N_PRODUCERS 4
+#define N_PRODUCED  2000
+
+static SockMuxSender *threaded_sender;
+static guint32 threaded_next[N_PRODUCERS];
+static gint threaded_received;
+
+static gboolean quit_loop_cb(gpointer data)
+{
+  g_main_loop_quit(loop);
+  return FALSE;
+}
+
+static gpointer producer_thread(gpointer data)
+{
+  guint message_id = GPOINTER_TO_UINT(data);
+  guint8 buf[512] = { 0 };
+  guint32 seq;
+
+  for (seq = 0; seq < N_PRODUCED; seq++)
+    {
+      memcpy(buf, &seq, sizeof(seq));
+      sockmux_sender_send(threaded_sender, message_id, buf,
+                          sizeof(seq) + seq % (sizeof(buf) - sizeof(seq)));
+    }
+
+  return NULL;
+}
+
+static void threaded_cb (SockMuxReceiver *rec,
+                         guint message_id,
+                         const guint8 *data,
+                         guint size,
+                         gpointer userdata)
+{
+  guint32 seq;
+
+  if (message_id < 1 || message_id > N_PRODUCERS || size < sizeof(seq))
+    {
+      g_error("threaded: unexpected message 0x%x, size %d", message_id, size);
+      exit(EXIT_FAILURE);
+    }
+
+  memcpy(&seq, data, sizeof(seq));
+  if (seq != threaded_next[message_id - 1]++)
+    {
+      g_error("threaded: message %u of producer %u out of order", seq, message_id);
+      exit(EXIT_FAILURE);
+    }
+
+  if (g_atomic_int_add(&threaded_received, 1) + 1 == N_PRODUCERS * N_PRODUCED)
+    g_idle_add(quit_loop_cb, NULL);
+}
+
+static void threaded_stream_end(SockMuxReceiver *rec,
+                                gpointer userdata)
+{
+  g_idle_add(quit_loop_cb, NULL);
+}
+
+static void threaded_sender_finalized(gpointer data,
+                                      GObject *object)
+{
+  if (g_main_context_get_thread_default() != data)
+    {
+      g_error("threaded: the sender was not finalized in its I/O thread");
+      exit(EXIT_FAILURE);
+    }
+
+  g_idle_add(quit_loop_cb, NULL);
+}
+
+static gboolean threaded_release(gpointer data)
+{
+  /* the sender's I/O thread drops the last references */
+  g_object_unref(data);
+  g_object_unref(threaded_sender);
+
+  return FALSE;
+}
+
+static void run_threaded(void)
+{
+  GThread *producers[N_PRODUCERS];
+  GInputStream *input;
+  GOutputStream *output;
+  GMainContext *context;
+  SockMuxReceiver *rec;
+  SockMuxSenderStats stats;
+  gint i, fds[2];
+
+  if (pipe(fds) < 0)
+    {
+      g_error("pipe() failed");
+      exit(EXIT_FAILURE);
+    }
+
+  input = g_unix_input_stream_new(fds[0], TRUE);
+  output = g_unix_output_stream_new(fds[1], TRUE);
+
+  threaded_sender = sockmux_sender_new_threaded(output, SOCKMUX_PROTOCOL_MAGIC, 2);
+  context = sockmux_sender_get_context(threaded_sender);
+  rec = sockmux_receiver_new_full(input, SOCKMUX_PROTOCOL_MAGIC, context);
+
+  g_signal_connect(rec, "protocol-error",
+                   G_CALLBACK(receiver_protocol_error), NULL);
+  g_signal_connect(rec, "stream-end",
+                   G_CALLBACK(threaded_stream_end), NULL);
+  sockmux_receiver_connect(rec, threaded_cb, NULL);
+
+  for (i = 0; i < N_PRODUCERS; i++)
+    producers[i] = g_thread_new("producer", producer_thread, GUINT_TO_POINTER(i + 1));
+
+  g_main_loop_run(loop);
+
+  for (i = 0; i < N_PRODUCERS; i++)
+    g_thread_join(producers[i]);
+
+  /* the last write may still be accounted for after the data arrived */
+  for (i = 0; i < 1000; i++)
+    {
+      sockmux_sender_get_stats(threaded_sender, &stats);
+      if (stats.queue_length == 0)
+        break;
+
+      g_usleep(1000);
+    }
+
+  if (stats.queue_length != 0 || stats.queue_size != 0 ||
+      stats.messages_sent != N_PRODUCERS * N_PRODUCED)
+    {
+      g_error("threaded: %u messages of %" G_GSIZE_FORMAT " bytes left in the queue, "
+              "%" G_GUINT64_FORMAT " sent",
+              stats.queue_length, stats.queue_size, stats.messages_sent);
+      exit(EXIT_FAILURE);
+    }
+
+  g_output_stream_close(output, NULL, NULL);
+  g_main_loop_run(loop);
+
+  g_object_weak_ref(G_OBJECT(threaded_sender), threaded_sender_finalized, context);
+  g_main_context_invoke(context, threaded_release, rec);
+  g_main_loop_run(loop);
+
+  g_object_unref(input);
+  g_object_unref(output);
+}
+
+/*
+ * Backpressure: messages sent with sockmux_sender_send_async() pile up
+ * while nobody reads the pipe, until "queue-full" is emitted. "writable"
+ * must only follow once the receiver has drained the queue, even if
+ * "low-watermark" was set above "high-watermark".
+ */
+#define WATERMARK_ID   0x200
+#define WATERMARK_HIGH (128 * 1024)
+#define WATERMARK_MSG  (16 * 1024)
+#define WATERMARK_MSGS 32
+
+static gsize watermark_full;
+static gsize watermark_writable;
+static gsize watermark_sent;
+
+static void watermark_full_cb(SockMuxSender *snd,
+                              gpointer userdata)
+{
+  watermark_full++;
+}
+
+static void watermark_writable_cb(SockMuxSender *snd,
+                                  gpointer userdata)
+{
+  if (watermark_full == 0)
+    {
+      g_error("watermark: writable emitted before queue-full");
+      exit(EXIT_FAILURE);
+    }
+
+  watermark_writable++;
+}
+
+static void watermark_sent_cb(GObject *source,
+                              GAsyncResult *result,
+                              gpointer userdata)
+{
+  GError *error = NULL;
+
+  if (!sockmux_sender_send_finish(SOCKMUX_SENDER(source), result, &error))
+    {
+      g_error("watermark: send failed: %s", error->message);
+      exit(EXIT_FAILURE);
+    }
+
+  watermark_sent++;
+}
+
+static void run_watermark(void)
+{
+  static guint8 data[WATERMARK_MSG];
+  GInputStream *input;
+  GOutputStream *output;
+  SockMuxSender *snd;
+  SockMuxReceiver *rec;
+  gint i, fds[2], low;
+
+  if (pipe(fds) < 0)
+    {
+      g_error("pipe() failed");
+      exit(EXIT_FAILURE);
+    }
+
+  input = g_unix_input_stream_new(fds[0], TRUE);
+  output = g_unix_output_stream_new(fds[1], TRUE);
+  snd = sockmux_sender_new_full(output, SOCKMUX_PROTOCOL_MAGIC, 2);
+
+  g_object_set(snd,
+               SOCKMUX_SENDER_PROP_LOW_WATERMARK, 4 * WATERMARK_HIGH,
+               SOCKMUX_SENDER_PROP_HIGH_WATERMARK, WATERMARK_HIGH,
+               NULL);
+  g_object_get(snd, SOCKMUX_SENDER_PROP_LOW_WATERMARK, &low, NULL);
+  if (low != WATERMARK_HIGH - 1)
+    {
+      g_error("watermark: low-watermark is %d, expected %d", low, WATERMARK_HIGH - 1);
+      exit(EXIT_FAILURE);
+    }
+
+  g_signal_connect(snd, "queue-full", G_CALLBACK(watermark_full_cb), NULL);
+  g_signal_connect(snd, "writable", G_CALLBACK(watermark_writable_cb), NULL);
+  watermark_full = 0;
+  watermark_writable = 0;
+  watermark_sent = 0;
+
+  for (i = 0; i < WATERMARK_MSGS; i++)
+    sockmux_sender_send_async(snd, WATERMARK_ID, data, sizeof(data),
+                              NULL, watermark_sent_cb, NULL);
+
+  /* the pipe is full and nobody reads it */
+  wait_for(&watermark_writable, 1);
+  if (watermark_full != 1 || watermark_writable != 0)
+    {
+      g_error("watermark: %" G_GSIZE_FORMAT " queue-full and %" G_GSIZE_FORMAT
+              " writable signals before the queue drained",
+              watermark_full, watermark_writable);
+      exit(EXIT_FAILURE);
+    }
+
+  rec = sockmux_receiver_new(input, SOCKMUX_PROTOCOL_MAGIC);
+  g_signal_connect(rec, "protocol-error",
+                   G_CALLBACK(receiver_protocol_error), NULL);
+  g_signal_connect(rec, "stream-end",
+                   G_CALLBACK(window_stream_end), NULL);
+  streams_ended = 0;
+
+  while (watermark_sent < WATERMARK_MSGS)
+    g_main_context_iteration(NULL, TRUE);
+
+  if (watermark_full != 1 || watermark_writable != 1)
+    {
+      g_error("watermark: %" G_GSIZE_FORMAT " queue-full and %" G_GSIZE_FORMAT
+              " writable signals, expected one each",
+              watermark_full, watermark_writable);
+      exit(EXIT_FAILURE);
+    }
+
+  g_object_unref(snd);
+  g_output_stream_close(output, NULL, NULL);
+
+  while (streams_ended < 1)
+    g_main_context_iteration(NULL, TRUE);
+
+  g_object_unref(rec);
+  g_object_unref(input);
+  g_object_unref(output);
+}
+
+/*
+ * The blocking API over a pipe, without a main loop: the handshake is
+ * checked, timeouts and cancellation end a read, and messages that
+ * arrive with one read are handed out one by one.
+ */
+#define BLOCKING_MSGS 3
+
+static const guint blocking_sizes[BLOCKING_MSGS] = { 16, 500, 0 };
+
+static void check_read_error(SockMuxReceiver *rec,
+                             gint timeout,
+                             GCancellable *cancellable,
+                             gint code)
+{
+  GError *error = NULL;
+
+  if (sockmux_receiver_read_message(rec, NULL, NULL, timeout, cancellable, &error))
+    {
+      g_error("blocking: read a message, expected error %d", code);
+      exit(EXIT_FAILURE);
+    }
+
+  if (!g_error_matches(error, G_IO_ERROR, code))
+    {
+      g_error("blocking: got \"%s\", expected error %d", error->message, code);
+      exit(EXIT_FAILURE);
+    }
+
+  g_error_free(error);
+}
+
+static gpointer cancel_thread(gpointer data)
+{
+  g_usleep(50 * 1000);
+  g_cancellable_cancel(data);
+
+  return NULL;
+}
+
+static void run_blocking(void)
+{
+  GInputStream *input;
+  GOutputStream *output;
+  SockMuxSender *snd;
+  SockMuxReceiver *rec;
+  SockMuxReceiverStats stats;
+  GCancellable *cancellable;
+  GThread *thread;
+  GError *error = NULL;
+  GBytes *payload;
+  guint8 data[500];
+  guint64 read_calls = 0;
+  guint message_id, i;
+  gint fds[2];
+
+  for (i = 0; i < sizeof(data); i++)
+    data[i] = i;
+
+  if (pipe(fds) < 0)
+    {
+      g_error("pipe() failed");
+      exit(EXIT_FAILURE);
+    }
+
+  input = g_unix_input_stream_new(fds[0], TRUE);
+  output = g_unix_output_stream_new(fds[1], TRUE);
+
+  /* a receiver for a different magic rejects the handshake */
+  snd = sockmux_sender_new_blocking(output, SOCKMUX_PROTOCOL_MAGIC + 1, 2);
+  rec = sockmux_receiver_new_blocking(input, SOCKMUX_PROTOCOL_MAGIC);
+
+  if (!sockmux_sender_send_sync(snd, 1, data, 16, NULL, &error))
+    {
+      g_error("blocking: send failed: %s", error->message);
+      exit(EXIT_FAILURE);
+    }
+
+  check_read_error(rec, 1000, NULL, G_IO_ERROR_INVALID_DATA);
+  g_object_unref(rec);
+  g_object_unref(snd);
+  g_object_unref(input);
+  g_object_unref(output);
+
+  if (pipe(fds) < 0)
+    {
+      g_error("pipe() failed");
+      exit(EXIT_FAILURE);
+    }
+
+  input = g_unix_input_stream_new(fds[0], TRUE);
+  output = g_unix_output_stream_new(fds[1], TRUE);
+  snd = sockmux_sender_new_blocking(output, SOCKMUX_PROTOCOL_MAGIC, 2);
+  rec = sockmux_receiver_new_blocking(input, SOCKMUX_PROTOCOL_MAGIC);
+  g_signal_connect(rec, "protocol-error",
+                   G_CALLBACK(receiver_protocol_error), NULL);
+
+  /* at most the handshake is there, but no message */
+  check_read_error(rec, 50, NULL, G_IO_ERROR_TIMED_OUT);
+
+  cancellable = g_cancellable_new();
+  thread = g_thread_new("cancel", cancel_thread, cancellable);
+  check_read_error(rec, 5000, cancellable, G_IO_ERROR_CANCELLED);
+  g_thread_join(thread);
+  g_object_unref(cancellable);
+
+  for (i = 0; i < BLOCKING_MSGS; i++)
+    if (!sockmux_sender_send_sync(snd, i + 1, data, blocking_sizes[i], NULL, &error))
+      {
+        g_error("blocking: send failed: %s", error->message);
+        exit(EXIT_FAILURE);
+      }
+
+  for (i = 0; i < BLOCKING_MSGS; i++)
+    {
+      if (!sockmux_receiver_read_message(rec, &message_id, &payload, 1000, NULL, &error))
+        {
+          g_error("blocking: read failed: %s", error->message);
+          exit(EXIT_FAILURE);
+        }
+
+      if (message_id != i + 1 ||
+          g_bytes_get_size(payload) != blocking_sizes[i] ||
+          memcmp(g_bytes_get_data(payload, NULL), data, blocking_sizes[i]) != 0)
+        {
+          g_error("blocking: message %u has ID 0x%x and %" G_GSIZE_FORMAT " bytes",
+                  i, message_id, g_bytes_get_size(payload));
+          exit(EXIT_FAILURE);
+        }
+
+      g_bytes_unref(payload);
+
+      /* the others were held from the first read */
+      sockmux_receiver_get_stats(rec, &stats);
+      if (i == 0)
+        read_calls = stats.read_calls;
+      else if (stats.read_calls != read_calls)
+        {
+          g_error("blocking: message %u took another read", i);
+          exit(EXIT_FAILURE);
+        }
+    }
+
+  check_read_error(rec, 50, NULL, G_IO_ERROR_TIMED_OUT);
+
+  g_object_unref(snd);
+  g_output_stream_close(output, NULL, NULL);
+  check_read_error(rec, 1000, NULL, G_IO_ERROR_CONNECTION_CLOSED);
+
+  g_object_unref(rec);
+  g_object_unref(input);
+  g_object_unref(output);
+}
+
+/*
+ * Batch callbacks get a single-frame message, one reassembled from
+ * several frames and an inflated one together if they arrive with one
+ * read. A batch callback disconnecting itself and another one from
+ * within the call ends both at once.
+ */
+#define BATCH_MSGS 3
+
+static const guint batch_sizes[BATCH_MSGS] = { 100, 4000, 32 * 1024 };
+static guint8 batch_data[32 * 1024];
+static gulong batch_first_id;
+static gulong batch_second_id;
+static guint batch_calls;
+static gsize batch_messages;
+
+static void batch_msg_cb (SockMuxReceiver *rec,
+                          guint message_id,
+                          const guint8 *data,
+                          guint size,
+                          gpointer userdata)
+{
+  batch_messages++;
+}
+
+static void batch_first_cb (SockMuxReceiver *rec,
+                            const SockMuxReceiverMessage *messages,
+                            guint n_messages,
+                            gpointer userdata)
+{
+  guint i;
+
+  if (n_messages != BATCH_MSGS)
+    {
+      g_error("batch: %u messages in one batch, expected %u", n_messages, BATCH_MSGS);
+      exit(EXIT_FAILURE);
+    }
+
+  for (i = 0; i < n_messages; i++)
+    if (messages[i].message_id != i + 1 ||
+        messages[i].size != batch_sizes[i] ||
+        memcmp(messages[i].data, batch_data, batch_sizes[i]) != 0)
+      {
+        g_error("batch: message %u has ID 0x%x and %u bytes",
+                i, messages[i].message_id, messages[i].size);
+        exit(EXIT_FAILURE);
+      }
+
+  batch_calls++;
+  sockmux_receiver_disconnect(rec, batch_second_id);
+  sockmux_receiver_disconnect(rec, batch_first_id);
+}
+
+static void batch_second_cb (SockMuxReceiver *rec,
+                             const SockMuxReceiverMessage *messages,
+                             guint n_messages,
+                             gpointer userdata)
+{
+  g_error("batch: disconnected batch callback called");
+  exit(EXIT_FAILURE);
+}
+
+/* hands everything the sender wrote to the receiver with a single feed */
+static void batch_feed(SockMuxSender *snd,
+                       GInputStream *input,
+                       SockMuxReceiver *rec)
+{
+  GByteArray *buf = g_byte_array_new();
+  guint8 chunk[4096];
+  GError *error = NULL;
+  gssize len;
+
+  while (sockmux_sender_get_queue_size(snd) > 0)
+    g_main_context_iteration(NULL, TRUE);
+
+  while ((len = g_pollable_input_stream_read_nonblocking(G_POLLABLE_INPUT_STREAM(input),
+                                                         chunk, sizeof(chunk),
+                                                         NULL, &error)) > 0)
+    g_byte_array_append(buf, chunk, len);
+
+  if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+    {
+      g_error("batch: read failed: %s", error ? error->message : "end of stream");
+      exit(EXIT_FAILURE);
+    }
+
+  g_error_free(error);
+  sockmux_receiver_feed(rec, buf->data, buf->len);
+  g_byte_array_free(buf, TRUE);
+}
+
+static void run_batch(void)
+{
+  GInputStream *input;
+  GOutputStream *output;
+  SockMuxSender *snd;
+  SockMuxReceiver *rec;
+  guint i;
+  gint fds[2];
+
+  /* compressible, but not trivially */
+  for (i = 0; i < sizeof(batch_data); i++)
+    batch_data[i] = (i / 64) % 7;
+
+  if (pipe(fds) < 0)
+    {
+      g_error("pipe() failed");
+      exit(EXIT_FAILURE);
+    }
+
+  input = g_unix_input_stream_new(fds[0], TRUE);
+  output = g_unix_output_stream_new(fds[1], TRUE);
+  snd = sockmux_sender_new_full(output, SOCKMUX_PROTOCOL_MAGIC, 2);
+  rec = sockmux_receiver_new(NULL, SOCKMUX_PROTOCOL_MAGIC);
+
+  /* only the last message is compressed, and only the second one split */
+  sockmux_sender_set_peer_capabilities(snd, SOCKMUX_CAPABILITY_ZLIB);
+  g_object_set(snd,
+               SOCKMUX_SENDER_PROP_MAX_CHUNK_SIZE, 1024,
+               SOCKMUX_SENDER_PROP_COMPRESSION, SOCKMUX_SENDER_COMPRESSION_ZLIB,
+               SOCKMUX_SENDER_PROP_COMPRESSION_THRESHOLD, 8192,
+               NULL);
+
+  g_signal_connect(rec, "protocol-error",
+                   G_CALLBACK(receiver_protocol_error), NULL);
+  sockmux_receiver_connect(rec, batch_msg_cb, NULL);
+  batch_first_id = sockmux_receiver_connect_batch(rec, batch_first_cb, NULL);
+  batch_second_id = sockmux_receiver_connect_batch(rec, batch_second_cb, NULL);
+  batch_calls = 0;
+  batch_messages = 0;
+
+  for (i = 0; i < BATCH_MSGS; i++)
+    sockmux_sender_send(snd, i + 1, batch_data, batch_sizes[i]);
+
+  batch_feed(snd, input, rec);
+
+  /* the message callbacks still run without any batch callback */
+  for (i = 0; i < BATCH_MSGS; i++)
+    sockmux_sender_send(snd, i + 1, batch_data, batch_sizes[i]);
+
+  batch_feed(snd, input, rec);
+
+  if (batch_calls != 1 || batch_messages != 2 * BATCH_MSGS)
+    {
+      g_error("batch: %u batches and %" G_GSIZE_FORMAT " messages, expected 1 and %u",
+              batch_calls, batch_messages, 2 * BATCH_MSGS);
+      exit(EXIT_FAILURE);
+    }
+
+  g_object_unref(snd);
+  g_object_unref(rec);
+  g_object_unref(input);
+  g_object_unref(output);
+}
+
+int main(int argc, char *argv[])
+{
+  g_type_init();
+  loop = g_main_loop_new(NULL, FALSE);
+
+  /* plain messages, then fragmented ones */
+  run(1);
+  run(2);
+
+  run_window();
+  run_threaded();
+  run_watermark();
+  run_blocking();
+  run_batch();
+
   return EXIT_SUCCESS;
 }